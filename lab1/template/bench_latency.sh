@@ -0,0 +1,42 @@
+#!/bin/bash
+# small-message round-trip latency of sserver under each transmission policy.
+# usage: ./bench_latency.sh [requests] [body size]
+#
+# one connection, one request in flight, so every number is a full round
+# trip. -L splits the response header from the body into two writes, -N
+# leaves Nagle on; the first row is the behaviour before coalescing.
+
+REQUESTS=${1:-300}
+SIZE=${2:-64}
+PORT=$((20000 + RANDOM % 20000))
+
+if [ ! -x ./sserver ] || [ ! -x ./sclient ]; then
+    echo "build sserver and sclient first (make)"
+    exit 1
+fi
+
+printf "%-10s %-26s %10s %10s %10s\n" "engine" "policy" "p50 us" "p99 us" "req/s"
+for ENGINE in "" "-e" "-u"; do
+    for POLICY in "-L -N" "-L" "-N" ""; do
+        case "$POLICY" in
+            "-L -N") DESC="split writes, Nagle" ;;
+            "-L")    DESC="split writes, NODELAY" ;;
+            "-N")    DESC="coalesced, Nagle" ;;
+            "")      DESC="coalesced, NODELAY" ;;
+        esac
+
+        ./sserver -p $PORT -w 1 $ENGINE $POLICY 2>/dev/null &
+        SPID=$!
+        sleep 0.3
+
+        OUT=$(./sclient -p $PORT -s 127.0.0.1 -n $REQUESTS -c 1 -z $SIZE)
+        P50=$(echo "$OUT" | awk '/^latency/ { print $6 }')
+        P99=$(echo "$OUT" | awk '/^latency/ { print $8 }')
+        RPS=$(echo "$OUT" | awk '/^throughput/ { print $2 }')
+        printf "%-10s %-26s %10s %10s %10s\n" "${ENGINE:-prefork}" "$DESC" "$P50" "$P99" "$RPS"
+
+        kill $SPID
+        wait $SPID 2>/dev/null
+        PORT=$((PORT + 1))
+    done
+done
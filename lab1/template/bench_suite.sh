@@ -0,0 +1,121 @@
+#!/bin/bash
+# benchmark suite: every engine against a generated payload corpus.
+# usage: ./bench_suite.sh [results.tsv]
+#        ./bench_suite.sh -d old.tsv new.tsv
+#
+# the corpus (bench_corpus/, made once by benchgen) holds text and binary
+# payloads from 64 B to MAX_CONT. each payload is echoed by each engine
+# over CONC keep-alive connections, moving about MB_PER_RUN MB per run.
+# one tab-separated row per run goes to the results file, named after the
+# current commit by default. -d compares two results files row by row.
+# ENGINES, CONC, MB_PER_RUN and WORKERS can be overridden from the
+# environment. WORKERS defaults to CONC: a prefork worker serves one
+# connection at a time, so more connections than workers would measure
+# the keep-alive timeout instead of the server.
+
+ENGINES=${ENGINES:-"prefork epoll uring threads"}
+CONC=${CONC:-4}
+MB_PER_RUN=${MB_PER_RUN:-256}
+WORKERS=${WORKERS:-$CONC}
+SIZES="64 1024 16384 262144 1048576 10485760"
+CORPUS=bench_corpus
+PORT=$((20000 + RANDOM % 20000))
+TCK=$(getconf CLK_TCK)
+COLUMNS="commit engine payload bytes conc requests errors req_s mb_s p50_us p99_us p999_us cpu_s rss_kb"
+
+if [ "$1" = "-d" ]; then
+    if [ $# -ne 3 ]; then
+        echo "usage: $0 -d old.tsv new.tsv"
+        exit 1
+    fi
+    # join on engine + payload, print the change of the main numbers
+    awk -F'\t' 'FNR == 1 { next }
+        NR == FNR { old[$2 FS $3] = $0; next }
+        ($2 FS $3) in old {
+            split(old[$2 FS $3], o, FS)
+            if (!hdr++)
+                printf "%-8s %-16s %18s %18s %18s\n", "engine", "payload",
+                       "MB/s", "p99 us", "cpu s"
+            printf "%-8s %-16s %9s %+7.1f%% %9s %+7.1f%% %9s %+7.1f%%\n",
+                   $2, $3, $9, pct(o[9], $9), $11, pct(o[11], $11), $13, pct(o[13], $13)
+        }
+        function pct(a, b) { return a > 0 ? (b - a) * 100 / a : 0 }' "$2" "$3"
+    exit 0
+fi
+
+if [ ! -x ./sserver ] || [ ! -x ./sclient ] || [ ! -x ./benchgen ]; then
+    echo "build sserver, sclient and benchgen first (make bench)"
+    exit 1
+fi
+
+REV=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+if [ -n "$(git status --porcelain -uno 2>/dev/null)" ]; then
+    REV="$REV+"
+fi
+RESULTS=${1:-bench-$REV.tsv}
+
+mkdir -p $CORPUS
+for SIZE in $SIZES; do
+    for KIND in text binary; do
+        [ -s $CORPUS/$KIND-$SIZE ] || ./benchgen $KIND $SIZE > $CORPUS/$KIND-$SIZE
+    done
+done
+
+# user + system seconds and summed peak RSS (kB) of a process and its children
+server_usage() {
+    local ticks=0 rss=0
+    for P in $1 $(ps --ppid $1 -o pid=); do
+        T=$(awk '{ print $14 + $15 }' /proc/$P/stat 2>/dev/null)
+        R=$(awk '/^VmHWM/ { print $2 }' /proc/$P/status 2>/dev/null)
+        ticks=$((ticks + ${T:-0}))
+        rss=$((rss + ${R:-0}))
+    done
+    echo "$(awk -v t=$ticks -v h=$TCK 'BEGIN { printf "%.2f", t / h }') $rss"
+}
+
+echo "$COLUMNS" | tr ' ' '\t' > "$RESULTS"
+printf "%-8s %-16s %8s %8s %10s %8s %8s %8s %8s\n" \
+       "engine" "payload" "requests" "errors" "MB/s" "p50 us" "p99 us" "cpu s" "rss kB"
+for ENGINE in $ENGINES; do
+    case $ENGINE in
+        prefork) FLAGS="-w $WORKERS" ;;
+        epoll)   FLAGS="-w $WORKERS -e" ;;
+        uring)   FLAGS="-w $WORKERS -u" ;;
+        threads) FLAGS="-t $WORKERS" ;;
+        *)       echo "unknown engine $ENGINE"; exit 1 ;;
+    esac
+    for SIZE in $SIZES; do
+        for KIND in text binary; do
+            N=$((MB_PER_RUN * 1024 * 1024 / SIZE))
+            [ $N -lt 100 ] && N=100
+            [ $N -gt 20000 ] && N=20000
+
+            ./sserver -p $PORT $FLAGS 2>/dev/null &
+            SPID=$!
+            sleep 0.3
+
+            OUT=$(./sclient -p $PORT -s 127.0.0.1 -n $N -c $CONC -z =$CORPUS/$KIND-$SIZE)
+            USAGE=$(server_usage $SPID)
+            kill $SPID
+            wait $SPID 2>/dev/null
+            PORT=$((PORT + 1))
+
+            echo "$OUT" | awk -v OFS='\t' -v rev=$REV -v engine=$ENGINE \
+                -v payload=$KIND-$SIZE -v bytes=$SIZE -v conc=$CONC -v n=$N \
+                -v usage="$USAGE" '
+                /^requests/   { err = $3; sub(/^\(/, "", err) }
+                /^throughput/ { rps = $2; mbs = $4 }
+                /^latency/    { p50 = $6; p99 = $8; p999 = $10 }
+                END {
+                    split(usage, u, " ")
+                    if (rps == "") err = n    # the client gave up
+                    print rev, engine, payload, bytes, conc, n, err, rps, mbs,
+                          p50, p99, p999, u[1], u[2]
+                }' >> "$RESULTS"
+            tail -1 "$RESULTS" | awk -F'\t' '{
+                printf "%-8s %-16s %8s %8s %10s %8s %8s %8s %8s\n",
+                       $2, $3, $6, $7, $9, $10, $11, $13, $14 }'
+        done
+    done
+done
+echo "results in $RESULTS"
@@ -0,0 +1,58 @@
+#!/bin/bash
+# server CPU time per GB echoed, splice() relay against -Z (MSG_ZEROCOPY).
+# usage: ./bench_zerocopy.sh [requests] [body sizes...]
+#
+# two connections, closed loop, prefork with two workers. the CPU time is
+# user + system of the parent and every worker, read from /proc just
+# before the server stops. on loopback the kernel copies zerocopy sends
+# anyway (the "copied" column); the saving only shows on a real NIC.
+
+REQUESTS=${1:-200}
+shift
+SIZES=${@:-"262144 1048576 8388608"}
+PORT=$((20000 + RANDOM % 20000))
+TCK=$(getconf CLK_TCK)
+
+if [ ! -x ./sserver ] || [ ! -x ./sclient ]; then
+    echo "build sserver and sclient first (make)"
+    exit 1
+fi
+
+# user + system ticks of a process and its children
+cpu_ticks() {
+    local total=0
+    for P in $1 $(ps --ppid $1 -o pid=); do
+        T=$(awk '{ print $14 + $15 }' /proc/$P/stat 2>/dev/null)
+        total=$((total + ${T:-0}))
+    done
+    echo $total
+}
+
+printf "%-10s %-10s %10s %12s %14s %10s\n" "bytes" "relay" "MB/s" "cpu s" "cpu s per GB" "copied"
+for SIZE in $SIZES; do
+    for MODE in "" "-Z 65536"; do
+        ./sserver -p $PORT -w 2 $MODE 2>/tmp/bench_zerocopy.$$ &
+        SPID=$!
+        sleep 0.3
+
+        OUT=$(./sclient -p $PORT -s 127.0.0.1 -n $REQUESTS -c 2 -z $SIZE)
+        TICKS=$(cpu_ticks $SPID)
+        kill -USR1 $SPID
+        sleep 0.2
+        kill $SPID
+        wait $SPID 2>/dev/null
+
+        MBS=$(echo "$OUT" | awk '/^throughput/ { print $4 }')
+        COPIED=$(tr -d ',' </tmp/bench_zerocopy.$$ |
+                 awk '/^zerocopy sends/ { c = $4 "/" $3 } END { print c ? c : "-" }')
+        awk -v size=$SIZE -v relay="${MODE:+zerocopy}" -v mbs=$MBS -v ticks=$TICKS \
+            -v tck=$TCK -v n=$REQUESTS -v copied="$COPIED" 'BEGIN {
+            cpu = ticks / tck
+            gb  = n * size * 2 / 1e9     # echoed: in and out
+            printf "%-10s %-10s %10s %12.2f %14.3f %10s\n",
+                   size, relay ? relay : "splice", mbs, cpu, cpu / gb, copied
+        }'
+        rm -f /tmp/bench_zerocopy.$$
+        PORT=$((PORT + 1))
+    done
+done
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/* writes one payload of the benchmark corpus to stdout.
+ * usage: benchgen text|binary bytes
+ *
+ * the bytes come from a fixed-seed xorshift, so every machine and every
+ * commit generates the same corpus. text is lowercase words and
+ * newlines, binary is all 256 byte values. */
+
+#define BLOCK (64*1024)
+
+static uint64_t g_rng = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next(void)
+{
+    g_rng ^= g_rng << 13;
+    g_rng ^= g_rng >> 7;
+    g_rng ^= g_rng << 17;
+    return g_rng;
+}
+
+/*--------------------------------------------------------------------------------*/
+int 
+main(const int argc, const char** argv)
+{
+    if (argc != 3 || (strcmp(argv[1], "text") != 0 && strcmp(argv[1], "binary") != 0)) {
+        fprintf(stderr, "usage: %s text|binary bytes\n", argv[0]);
+        return 1;
+    }
+    int text = (argv[1][0] == 't');
+    long remain = atol(argv[2]);
+    static unsigned char buf[BLOCK];
+    int col = 0;
+
+    while (remain > 0) {
+        size_t n = (remain < BLOCK) ? remain : BLOCK;
+        for (size_t k = 0; k < n; k++) {
+            uint64_t r = next();
+            if (!text) {
+                buf[k] = r & 0xff;
+            } else if (++col >= 72) {   /* lines of at most 72 bytes */
+                buf[k] = '\n';
+                col = 0;
+            } else {
+                buf[k] = (r % 6 == 0) ? ' ' : 'a' + (r >> 8) % 26;
+            }
+        }
+        if (fwrite(buf, 1, n, stdout) != n) {
+            perror("fwrite");
+            return 1;
+        }
+        remain -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "macro.h"
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_POLY 0x82f63b78u   /* Castagnoli, bit-reversed */
+
+/* g_table[0] is the classic byte table; g_table[k][b] is the crc of byte b
+ * followed by k zero bytes, so eight table lookups advance eight bytes */
+static uint32_t g_table[8][256];
+static uint32_t (*g_update)(uint32_t, const void *, size_t) = crc32c_sw;
+
+/* runs before main(), so the tables are read-only once threads exist */
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        g_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++)
+            g_table[k][b] = (g_table[k-1][b] >> 8) ^ g_table[0][g_table[k-1][b] & 0xff];
+    }
+    if (crc32c_hw_available()) g_update = crc32c_hw;
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+    return g_update(crc, buf, len);
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    crc = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    /* the loads are spelled out byte by byte, which keeps this correct
+     * on big-endian machines; compilers turn them into plain loads here */
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8
+                             | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8
+                    | (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        crc = g_table[7][lo & 0xff] ^ g_table[6][(lo >> 8) & 0xff]
+            ^ g_table[5][(lo >> 16) & 0xff] ^ g_table[4][lo >> 24]
+            ^ g_table[3][hi & 0xff] ^ g_table[2][(hi >> 8) & 0xff]
+            ^ g_table[1][(hi >> 16) & 0xff] ^ g_table[0][hi >> 24];
+        p   += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+
+/* built for SSE4.2 on its own, so the rest of the program does not need
+ * -msse4.2; only called once crc32c_hw_available() said yes */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    uint64_t c = ~crc;
+
+    while (len > 0 && ((uintptr_t)p & 7)) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        c = _mm_crc32_u64(c, word);
+        p   += 8;
+        len -= 8;
+    }
+    while (len > 0) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+        len--;
+    }
+    return ~(uint32_t)c;
+}
+
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sse42(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+    return __builtin_cpu_supports("sse4.2");
+}
+
+#else
+
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len)
+{
+    return crc32c_sw(crc, buf, len);
+}
+
+int crc32c_hw_available(void)
+{
+    return FALSE;
+}
+
+#endif
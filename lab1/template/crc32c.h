@@ -0,0 +1,19 @@
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32C (Castagnoli), the checksum carried in Content-crc32c. all three
+ * take the crc of the bytes so far (0 to start) and return it extended by
+ * buf[0, len), so a body can be checked chunk by chunk as it arrives.
+ * crc32c_update() uses the SSE4.2 crc32 instruction where the CPU has it
+ * and slicing-by-8 tables everywhere else */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len);
+
+/* whether crc32c_hw() can run on this CPU */
+int      crc32c_hw_available(void);
+
+#endif
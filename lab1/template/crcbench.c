@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "macro.h"
+#include "crc32c.h"
+
+/* crc32c throughput: the slicing-by-8 fallback against the SSE4.2 path
+ * that crc32c_update() picks on x86-64, at a few body sizes.
+ * usage: crcbench [megabytes per size]
+ *
+ * each size is hashed in 64 KB steps, the way the server and client feed
+ * it, until the given amount of data has gone through. */
+
+static const size_t g_sizes[] = { 64, 4096, 65536, 1024 * 1024, MAX_CONT };
+#define NUM_SIZES (int)(sizeof(g_sizes) / sizeof(g_sizes[0]))
+#define STEP (64*1024)
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MB/s of fn over buf[0, size), repeated until total bytes are done */
+static double run(uint32_t (*fn)(uint32_t, const void *, size_t),
+                  const unsigned char *buf, size_t size, size_t total, uint32_t *out)
+{
+    size_t rounds = total / size ? total / size : 1;
+    uint32_t crc = 0;
+
+    double t0 = now_sec();
+    for (size_t r = 0; r < rounds; r++) {
+        crc = 0;
+        for (size_t off = 0; off < size; off += STEP)
+            crc = fn(crc, buf + off, (size - off < STEP) ? size - off : STEP);
+    }
+    double t1 = now_sec();
+
+    *out = crc;
+    return (double)rounds * size / (t1 - t0) / (1024 * 1024);
+}
+
+/*--------------------------------------------------------------------------------*/
+int 
+main(const int argc, const char** argv)
+{
+    long mb = (argc > 1) ? atol(argv[1]) : 512;
+    if (mb <= 0) {
+        printf("usage: %s [megabytes per size]\n", argv[0]);
+        exit(-1);
+    }
+
+    /* the standard check value: crc32c("123456789") */
+    const char *check = "123456789";
+    if (crc32c_sw(0, check, 9) != 0xe3069283u
+        || crc32c_update(0, check, 9) != 0xe3069283u) {
+        fprintf(stderr, "crc32c check value mismatch\n");
+        exit(-1);
+    }
+
+    unsigned char *buf = (unsigned char *)malloc(MAX_CONT);
+    if (!buf) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(-1);
+    }
+    srand(1);
+    for (size_t k = 0; k < MAX_CONT; k++)
+        buf[k] = (unsigned char)rand();
+
+    int hw = crc32c_hw_available();
+    printf("sse4.2 %s\n", hw ? "available" : "not available");
+    printf("%-10s %14s %14s %8s\n", "bytes", "sliced MB/s", "sse4.2 MB/s", "speedup");
+    for (int k = 0; k < NUM_SIZES; k++) {
+        uint32_t a, b;
+        double sw = run(crc32c_sw, buf, g_sizes[k], (size_t)mb * 1024 * 1024, &a);
+        if (!hw) {
+            printf("%-10zu %14.0f %14s %8s\n", g_sizes[k], sw, "-", "-");
+            continue;
+        }
+        double hwRate = run(crc32c_hw, buf, g_sizes[k], (size_t)mb * 1024 * 1024, &b);
+        if (a != b) {
+            fprintf(stderr, "%zu bytes: implementations disagree\n", g_sizes[k]);
+            exit(-1);
+        }
+        printf("%-10zu %14.0f %14.0f %7.1fx\n", g_sizes[k], sw, hwRate, hwRate / sw);
+    }
+    free(buf);
+    return 0;
+}
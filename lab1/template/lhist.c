@@ -0,0 +1,68 @@
+#include <string.h>
+
+#include "lhist.h"
+
+#define SUB_COUNT (1u << LHIST_SUB_BITS)
+
+static unsigned bucket_of(uint64_t v)
+{
+    if (v < 2 * SUB_COUNT) return (unsigned)v;
+
+    unsigned msb   = 63 - __builtin_clzll(v);
+    unsigned shift = msb - LHIST_SUB_BITS;
+    return shift * SUB_COUNT + (unsigned)(v >> shift);
+}
+
+/* largest value that still falls into bucket idx */
+static uint64_t bucket_high(unsigned idx)
+{
+    if (idx < 2 * SUB_COUNT) return idx;
+
+    unsigned shift = idx / SUB_COUNT - 1;
+    uint64_t mant  = idx % SUB_COUNT + SUB_COUNT;
+    return ((mant + 1) << shift) - 1;
+}
+
+void lhist_init(struct lhist *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void lhist_record(struct lhist *h, uint64_t v)
+{
+    h->bucket[bucket_of(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+void lhist_merge(struct lhist *dst, const struct lhist *src)
+{
+    for (unsigned i = 0; i < LHIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+    dst->count += src->count;
+    dst->sum   += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t lhist_percentile(const struct lhist *h, double pct)
+{
+    if (h->count == 0) return 0;
+
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LHIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_high(i);
+            return (v > h->max) ? h->max : v;
+        }
+    }
+    return h->max;
+}
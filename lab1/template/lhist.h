@@ -0,0 +1,28 @@
+#ifndef LHIST_H_
+#define LHIST_H_
+
+#include <stdint.h>
+
+/* log-bucketed latency histogram. values below 32 get exact buckets; above
+ * that every power of two is split into 16 sub-buckets, so a reported
+ * percentile is within ~6% of the true value over the whole uint64 range.
+ * the struct holds no pointers, so it can live in a shared mapping. */
+#define LHIST_SUB_BITS 4
+#define LHIST_BUCKETS  ((64 - LHIST_SUB_BITS + 1) << LHIST_SUB_BITS)
+
+struct lhist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t bucket[LHIST_BUCKETS];
+};
+
+void     lhist_init(struct lhist *h);
+void     lhist_record(struct lhist *h, uint64_t v);
+void     lhist_merge(struct lhist *dst, const struct lhist *src);
+
+/* highest value equivalent to the pct-th percentile (0 < pct <= 100) */
+uint64_t lhist_percentile(const struct lhist *h, double pct);
+
+#endif
@@ -7,6 +7,27 @@
 #define MAX_CONT (10*1024*1024)  /* maximum content length */
 #define MAX_HDR  (1024)          /* maximum header length */
 
+/* keep-alive negotiation: a request carrying this header is answered with
+ * the same header and the connection stays open for the next request.
+ * without it the server closes after one response, as in plain SIMPLE/1.0 */
+#define KEEPALIVE_HDR "Connection: keep-alive\r\n"
+
+/* chunked framing: a body of unknown length is sent as a series of
+ * "<hex size>\r\n<data>\r\n" chunks closed by "0\r\n\r\n", with this header
+ * in place of Content-length. the echo comes back framed the same way */
+#define CHUNKED_HDR   "Transfer-encoding: chunked\r\n"
+#define CHUNK_END     "0\r\n\r\n"
+
+/* integrity check: the CRC-32C (crc32c.h) of a Content-length body, as 8
+ * hex digits. the server verifies the body against it while relaying */
+#define CRC32C_HDR    "Content-crc32c: %08x\r\n"
+
+/* SIMPLE/2.0: a connection that opens with this preface instead of a
+ * request switches to binary frames (see simple_parse.h) once the server
+ * has answered with the same preface */
+#define SIMPLE2_VERSION "SIMPLE/2.0"
+#define SIMPLE2_PREFACE SIMPLE2_VERSION "\r\n\r\n"
+
 /* debug trace */
 #ifndef OFFTRACE
 #define TRACE(fmt, msg...) \
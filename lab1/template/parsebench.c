@@ -0,0 +1,177 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "macro.h"
+#include "simple_parse.h"
+
+/* parse_request_header() against the strtok_r/strdup parser it replaced.
+ * usage: parsebench [iterations]
+ *
+ * the legacy parser writes into the header, so every iteration of both
+ * parsers starts from a fresh copy of the sample; the copy costs the same
+ * on both sides. */
+
+static const char *g_samples[] = {
+    "POST message SIMPLE/1.0\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Content-length: 64",
+
+    "POST message SIMPLE/1.0\r\n"
+    "Host: 127.0.0.1\r\n"
+    "Content-length: 4096\r\n"
+    "Connection: keep-alive",
+
+    "POST message SIMPLE/1.0\r\n"
+    "Host: example.com\r\n"
+    "Transfer-encoding: chunked\r\n"
+    "Connection: keep-alive",
+
+    "POST message SIMPLE/1.0\r\n"
+    "Host: example.com\r\n"
+    "User-agent: parsebench/1.0\r\n"
+    "Accept: */*\r\n"
+    "X-request-id: 8d9f0c1e-55aa-4b7c-9e3f-3a1b2c4d5e6f\r\n"
+    "Content-length: 1048576\r\n"
+    "Connection: keep-alive",
+};
+#define NUM_SAMPLES (int)(sizeof(g_samples) / sizeof(g_samples[0]))
+
+static int legacy_parse_request_header(char *headerBuf, size_t headerLen,
+                                       struct request_info *req)
+{
+    
+    headerBuf[headerLen] = '\0';
+
+    char *saveptr = NULL;
+    char *line = strtok_r(headerBuf, "\r\n", &saveptr);
+
+    
+    if (!line) {
+        return -1;
+    }
+
+    {
+        
+        
+        char *saveptr2 = NULL;
+        char *token1 = strtok_r(line, " \t", &saveptr2);
+        char *token2 = strtok_r(NULL, " \t", &saveptr2);
+        char *token3 = strtok_r(NULL, " \t", &saveptr2);
+
+        if (!token1 || !token2 || !token3) {
+            return -1;
+        }
+
+        if (strcmp(token1, "POST") != 0) {
+            return -1;
+        }
+        if (strcasecmp(token2, "message") != 0) {
+            return -1;
+        }
+        if (strcasecmp(token3, "SIMPLE/1.0") != 0) {
+            return -1;
+        }
+    }
+
+    
+    int foundHost = 0;
+    int foundCL   = 0;
+    req->contentLen = 0;
+    req->keepAlive  = 0;
+    req->chunked    = 0;
+
+    while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
+
+        char *lower = strdup(line);
+        if (!lower) continue;
+        for (char *pp = lower; *pp; pp++)
+            *pp = tolower((unsigned char)*pp);
+
+        if (strstr(lower, "host:") == lower) {
+            foundHost = 1;
+        }
+        else if (strstr(lower, "content-length:") == lower) {
+            foundCL = 1;
+            
+            char *numPtr = strchr(line, ':');
+            if (numPtr) {
+                numPtr++; 
+                while (*numPtr && isspace((unsigned char)*numPtr)) numPtr++;
+                unsigned long long val = strtoull(numPtr, NULL, 10);
+                req->contentLen = (size_t)val;
+            }
+        }
+        else if (strstr(lower, "connection:") == lower) {
+            req->keepAlive = (strstr(lower, "keep-alive") != NULL);
+        }
+        else if (strstr(lower, "transfer-encoding:") == lower) {
+            req->chunked = (strstr(lower, "chunked") != NULL);
+        }
+        free(lower);
+    }
+
+    /* exactly one of Content-length and chunked framing delimits the body */
+    if (!foundHost || foundCL == req->chunked) {
+        return -1;
+    }
+    return 0; 
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*--------------------------------------------------------------------------------*/
+int 
+main(const int argc, const char** argv)
+{
+    long iters = (argc > 1) ? atol(argv[1]) : 2000000;
+    char buf[MAX_HDR + 1];
+    volatile size_t sink = 0;
+
+    if (iters <= 0) {
+        printf("usage: %s [iterations]\n", argv[0]);
+        exit(-1);
+    }
+
+    printf("%-10s %-8s %12s %12s %8s\n", "sample", "bytes", "legacy ns", "new ns", "speedup");
+    for (int k = 0; k < NUM_SAMPLES; k++) {
+        size_t len = strlen(g_samples[k]);
+        struct request_info a, b;
+
+        /* both parsers must agree before their speed means anything */
+        memcpy(buf, g_samples[k], len + 1);
+        if (legacy_parse_request_header(buf, len, &a) != 0
+            || parse_request_header(g_samples[k], len, &b) != 0
+            || a.contentLen != b.contentLen || a.keepAlive != b.keepAlive
+            || a.chunked != b.chunked) {
+            fprintf(stderr, "sample %d: parsers disagree\n", k);
+            exit(-1);
+        }
+
+        double t0 = now_sec();
+        for (long i = 0; i < iters; i++) {
+            memcpy(buf, g_samples[k], len + 1);
+            legacy_parse_request_header(buf, len, &a);
+            sink += a.contentLen;
+        }
+        double t1 = now_sec();
+        for (long i = 0; i < iters; i++) {
+            memcpy(buf, g_samples[k], len + 1);
+            parse_request_header(buf, len, &b);
+            sink += b.contentLen;
+        }
+        double t2 = now_sec();
+
+        double legacyNs = (t1 - t0) * 1e9 / iters;
+        double newNs    = (t2 - t1) * 1e9 / iters;
+        printf("%-10d %-8zu %12.1f %12.1f %7.1fx\n", k, len, legacyNs, newNs, legacyNs / newNs);
+    }
+    return 0;
+}
@@ -2,6 +2,8 @@
 #include <sys/types.h>          /* See NOTES */
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,8 +11,92 @@
 #include <unistd.h>
 #include <signal.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <poll.h>
 
 #include "macro.h"
+#include "simple_io.h"
+#include "simple_parse.h"
+#include "sclient.h"
+#include "crc32c.h"
+
+#define SEND_STAGE (64*1024)    /* small requests are batched up to this */
+#define CHUNK_ROOM 24           /* stage bytes reserved for a chunk frame */
+#define FILE_CHUNK (1024*1024)  /* chunk size for files above MAX_CONT */
+
+/* where a request body comes from */
+enum msg_kind {
+    MSG_MEM,                  /* bytes in memory (-l lines) */
+    MSG_FILE,                 /* regular file, sent with sendfile() */
+    MSG_PIPE                  /* unknown length, sent chunked as it is read */
+};
+
+/* one request body */
+struct message {
+    enum msg_kind kind;
+    const unsigned char *data;  /* MSG_MEM */
+    int    fd;                  /* MSG_FILE, MSG_PIPE */
+    off_t  offset;              /* MSG_FILE: sendfile() position */
+    size_t len;                 /* MSG_MEM, MSG_FILE */
+    int    chunked;             /* MSG_PIPE, or a file above MAX_CONT */
+};
+
+/* request side: headers and small bodies are staged back to back so that a
+ * pipelined batch leaves in few write() calls. a large in-memory body is
+ * written straight from the message, a file body goes out with sendfile(),
+ * and a chunked body is framed one chunk at a time. */
+struct sender {
+    const struct message *msgs;
+    size_t nmsg;
+    size_t next;              /* next message to stage */
+    const char *host;
+    int    keepAlive;
+    uint32_t *crcs;           /* -k: crc32c of each message, else NULL */
+
+    char   stage[SEND_STAGE];
+    size_t stageLen;
+    size_t stageSent;
+
+    const unsigned char *body;
+    size_t bodyLen;
+    size_t bodySent;
+
+    int    fileFd;            /* sendfile() source while fileLeft > 0 */
+    off_t  fileOff;
+    size_t fileLeft;
+
+    const struct message *stream;  /* chunked message in progress */
+    size_t streamIdx;
+    size_t streamLeft;        /* file bytes not yet framed into a chunk */
+    int    chunkOpen;         /* last chunk still owes its CRLF */
+    int    needInput;         /* waiting for the pipe to become readable */
+
+    int    done;
+};
+
+/* response side, advanced as the socket becomes readable */
+struct response {
+    struct rbuf rb;
+    size_t expected;          /* responses still to come */
+    int    inBody;            /* header parsed, copying the body to stdout */
+    int    chunked;
+    enum chunk_phase chunkPhase;
+    size_t remain;            /* body (or chunk) bytes still expected */
+    const uint32_t *crcs;     /* -k: what each echo has to hash to */
+    size_t nmsg;
+    uint32_t crc;             /* of the current echo so far */
+    int    done;
+};
+
+static unsigned char *read_input(FILE *fp, size_t *lenOut);
+static int  open_message(struct message *m, int fd, const char *name);
+static int  message_crc(const struct message *m, uint32_t *out);
+static void sender_init(struct sender *snd, const struct message *msgs, size_t nmsg,
+                        const char *host, int keepAlive, uint32_t *crcs);
+static int  sender_on_writable(struct sender *snd, int s);
+static int  sender_on_input(struct sender *snd);
+static void response_init(struct response *resp, size_t expected, const uint32_t *crcs);
+static int  response_on_readable(struct response *resp, int s);
 
 /*--------------------------------------------------------------------------------*/
 int 
@@ -18,6 +104,11 @@ main(const int argc, const char** argv)
 {
     const char *pserver = NULL;
     int port = -1;
+    int perLine = FALSE;
+    int checkCrc = FALSE;
+    struct load_config load = { .concurrency = 1, .sizeSpec = "64" };
+    const char *files[argc];
+    int nfiles = 0;
     int i;
       
     /* argument processing */
@@ -28,12 +119,34 @@ main(const int argc, const char** argv)
         } else if (strcmp(argv[i], "-s") == 0 && (i + 1) < argc) {
             pserver = argv[i+1];
             i++;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            perLine = TRUE;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            checkCrc = TRUE;
+        } else if (strcmp(argv[i], "-n") == 0 && (i + 1) < argc) {
+            load.requests = atol(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0 && (i + 1) < argc) {
+            load.concurrency = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-r") == 0 && (i + 1) < argc) {
+            load.rate = atof(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-z") == 0 && (i + 1) < argc) {
+            load.sizeSpec = argv[i+1];
+            i++;
+        } else if (strcmp(argv[i], "-2") == 0) {
+            load.simple2 = TRUE;
+        } else if (argv[i][0] != '-') {
+            files[nfiles++] = argv[i];
         }
     }
 
     /* check arguments */
     if (port < 0 || pserver == NULL) {
-        printf("usage: %s -p port -s server-ip\n", argv[0]);
+        printf("usage: %s -p port -s server-ip [-k] [-l | file ...]\n"
+               "       %s -p port -s server-ip -n requests [-c concurrency] [-r rate]"
+               " [-z size | min-max | @file | =file] [-2]\n", argv[0], argv[0]);
         exit(-1);
     }
     if (port < 1024 || port > 65535) {
@@ -41,41 +154,99 @@ main(const int argc, const char** argv)
         exit(-1);
     }
 
+    /* load generator mode */
+    if (load.requests > 0) {
+        if (load.concurrency < 1 || load.rate < 0) {
+            printf("concurrency should be >= 1 and rate >= 0.\n");
+            exit(-1);
+        }
+        signal(SIGPIPE, SIG_IGN);
+        load.server = pserver;
+        load.port   = port;
+        return run_load(&load);
+    }
+
     
     {
 
         signal(SIGPIPE, SIG_IGN);
 
-        unsigned char *sendBuf = (unsigned char *)malloc(MAX_CONT);
-        if (!sendBuf) {
-            fprintf(stderr, "Memory allocation failed\n");
-            exit(-1);
-        }
+        /* one message per file, one per stdin line (-l), or all of stdin.
+         * with more than one message they are pipelined over a single
+         * keep-alive connection. only -l stages its input in memory; files
+         * and stdin are streamed straight from their descriptors. */
+        struct message *msgs = NULL;
+        size_t nmsg = 0;
+        unsigned char *lineBuf = NULL;
 
-        size_t totalRead = 0;
-        while (1) {
-            if (totalRead >= MAX_CONT) {
-                char discardBuf[1024];
-                if (!fread(discardBuf, 1, sizeof(discardBuf), stdin)) {
-                    break;  
+        if (nfiles > 0) {
+            msgs = (struct message *)calloc(nfiles, sizeof(*msgs));
+            if (!msgs) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(-1);
+            }
+            for (i = 0; i < nfiles; i++) {
+                int fd = open(files[i], O_RDONLY);
+                if (fd < 0) {
+                    perror(files[i]);
+                    exit(-1);
+                }
+                if (open_message(&msgs[nmsg++], fd, files[i]) < 0) {
+                    exit(-1);
                 }
-                continue;
             }
-            size_t canRead = MAX_CONT - totalRead;
-            size_t n = fread(sendBuf + totalRead, 1, canRead, stdin);
-            if (n == 0) {
-                
-                if (feof(stdin) || ferror(stdin)) {
-                    break;
+        } else if (perLine) {
+            size_t totalRead = 0;
+            lineBuf = read_input(stdin, &totalRead);
+            if (totalRead == 0) {
+                fprintf(stderr, "Error: no input data (0 bytes)\n");
+                exit(-1);
+            }
+
+            size_t cap = 1;
+            for (size_t k = 0; k < totalRead; k++)
+                if (lineBuf[k] == '\n') cap++;
+            msgs = (struct message *)calloc(cap, sizeof(*msgs));
+            if (!msgs) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(-1);
+            }
+
+            /* lines keep their '\n' so the echoed output equals the input */
+            size_t from = 0;
+            for (size_t k = 0; k <= totalRead; k++) {
+                if (k == totalRead ? from < totalRead : lineBuf[k] == '\n') {
+                    size_t end = (k == totalRead) ? k : k + 1;
+                    msgs[nmsg].kind = MSG_MEM;
+                    msgs[nmsg].data = lineBuf + from;
+                    msgs[nmsg].len  = end - from;
+                    nmsg++;
+                    from = end;
                 }
             }
-            totalRead += n;
+        } else {
+            msgs = (struct message *)calloc(1, sizeof(*msgs));
+            if (!msgs) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(-1);
+            }
+            if (open_message(&msgs[nmsg++], STDIN_FILENO, "stdin") < 0) {
+                exit(-1);
+            }
         }
 
-        if (totalRead == 0) {
-            fprintf(stderr, "Error: no input data (0 bytes)\n");
-            free(sendBuf);
-            exit(-1);
+        /* -k: every body carries its crc32c and every echo is checked
+         * against it. a pipe is hashed as it is read (sender_on_input()),
+         * anything else up front, since the header leaves first */
+        uint32_t *crcs = NULL;
+        if (checkCrc) {
+            crcs = (uint32_t *)calloc(nmsg, sizeof(*crcs));
+            if (!crcs) {
+                fprintf(stderr, "Memory allocation failed\n");
+                exit(-1);
+            }
+            for (size_t k = 0; k < nmsg; k++)
+                if (message_crc(&msgs[k], &crcs[k]) < 0) exit(-1);
         }
 
         int s;
@@ -85,7 +256,6 @@ main(const int argc, const char** argv)
         s = socket(AF_INET, SOCK_STREAM, 0);
         if (s < 0) {
             perror("socket");
-            free(sendBuf);
             exit(-1);
         }
 
@@ -94,194 +264,504 @@ main(const int argc, const char** argv)
 
         if (inet_pton(AF_INET, pserver, &saddr.sin_addr) <= 0) {
             fprintf(stderr, "Invalid server IP address.\n");
-            free(sendBuf);
             close(s);
             exit(-1);
         }
 
         if (connect(s, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
             perror("connect");
-            free(sendBuf);
             close(s);
             exit(-1);
         }
 
-        char header[2048];
-        snprintf(header, sizeof(header),
-                 "POST message SIMPLE/1.0\r\n"
-                 "Host: %s\r\n"
-                 "Content-length: %zu\r\n"
-                 "\r\n",              
-                 pserver, totalRead);
-
-        {
-            size_t sentBytes = 0;
-            size_t headerLen = strlen(header);
-            while (sentBytes < headerLen) {
-                ssize_t wn = write(s, header + sentBytes, headerLen - sentBytes);
-                if (wn < 0) {
-                    perror("write header");
-                    free(sendBuf);
+        /* the server echoes the body while it is still arriving, so the
+         * response has to be drained while the request is being written;
+         * otherwise both sides can block on full socket buffers. */
+        int flags = fcntl(s, F_GETFL, 0);
+        if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0) {
+            perror("fcntl");
+            close(s);
+            exit(-1);
+        }
+
+        struct sender snd;
+        sender_init(&snd, msgs, nmsg, pserver, nmsg > 1, crcs);
+
+        struct response resp;
+        response_init(&resp, nmsg, crcs);
+
+        while (!resp.done) {
+            struct pollfd pfd[2];
+            int npfd = 1;
+            pfd[0].fd      = s;
+            pfd[0].events  = POLLIN | ((snd.done || snd.needInput) ? 0 : POLLOUT);
+            pfd[0].revents = 0;
+            if (snd.needInput) {
+                pfd[1].fd      = snd.stream->fd;
+                pfd[1].events  = POLLIN;
+                pfd[1].revents = 0;
+                npfd = 2;
+            }
+            if (poll(pfd, npfd, -1) < 0) {
+                if (errno == EINTR) continue;
+                perror("poll");
+                close(s);
+                exit(-1);
+            }
+
+            if (npfd == 2 && pfd[1].revents) {
+                if (sender_on_input(&snd) < 0) {
                     close(s);
                     exit(-1);
                 }
-                sentBytes += wn;
             }
-        }
 
-        {
-            size_t sentBytes = 0;
-            while (sentBytes < totalRead) {
-                ssize_t wn = write(s, sendBuf + sentBytes, totalRead - sentBytes);
-                if (wn < 0) {
-                    perror("write body");
-                    free(sendBuf);
+            if (!snd.done && !snd.needInput && (pfd[0].revents & POLLOUT)) {
+                if (sender_on_writable(&snd, s) < 0) {
+                    close(s);
+                    exit(-1);
+                }
+            }
+
+            if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (response_on_readable(&resp, s) < 0) {
                     close(s);
                     exit(-1);
                 }
-                sentBytes += wn;
             }
         }
 
-        free(sendBuf);
+        for (size_t k = 0; k < nmsg; k++)
+            if (msgs[k].kind != MSG_MEM && msgs[k].fd != STDIN_FILENO)
+                close(msgs[k].fd);
+        free(lineBuf);
+        free(crcs);
+        free(msgs);
+        close(s);
+        return 0;
+    }
+}
 
-        char respHeader[MAX_HDR + 1];
-        memset(respHeader, 0, sizeof(respHeader));
-        size_t headerUsed = 0;
-        int headerComplete = 0;
+/* reads fp to EOF into a malloc()ed buffer; anything past MAX_CONT is
+ * discarded */
+static unsigned char *read_input(FILE *fp, size_t *lenOut)
+{
+    unsigned char *sendBuf = (unsigned char *)malloc(MAX_CONT);
+    if (!sendBuf) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(-1);
+    }
 
-        while (!headerComplete) {
-            if (headerUsed >= MAX_HDR) {
-                
-                fprintf(stderr, "Error: response header exceeds %d bytes\n", MAX_HDR);
-                close(s);
-                exit(-1);
+    size_t totalRead = 0;
+    while (1) {
+        if (totalRead >= MAX_CONT) {
+            char discardBuf[1024];
+            if (!fread(discardBuf, 1, sizeof(discardBuf), fp)) {
+                break;  
             }
-            ssize_t rn = read(s, respHeader + headerUsed, 1);
-            if (rn < 0) {
-                perror("read");
-                close(s);
-                exit(-1);
-            } else if (rn == 0) {
-                
+            continue;
+        }
+        size_t canRead = MAX_CONT - totalRead;
+        size_t n = fread(sendBuf + totalRead, 1, canRead, fp);
+        if (n == 0) {
+            
+            if (feof(fp) || ferror(fp)) {
                 break;
             }
-            headerUsed += rn;
-            if (headerUsed >= 4 &&
-                strstr(respHeader, "\r\n\r\n") != NULL) {
-                headerComplete = 1;
-            }
         }
-        respHeader[headerUsed] = '\0'; 
-
-        
-        int is200 = 0;
-        size_t contentLength = 0;
-        {
-            char *lines = strdup(respHeader);
-            if (!lines) {
-                fprintf(stderr, "strdup fail\n");
-                close(s);
-                exit(-1);
-            }
-            char *saveptr = NULL;
-            char *line = strtok_r(lines, "\r\n", &saveptr);
-            
-            if (line) {
-                
-                char *p = line;
-                
-                if (strncmp(p, "SIMPLE/1.0", 10) == 0) {
-                    
-                    
-                    if (strstr(line, "200") != NULL && strstr(line, "OK") != NULL) {
-                        is200 = 1;
-                    }
-                }
+        totalRead += n;
+    }
+
+    *lenOut = totalRead;
+    return sendBuf;
+}
+
+/* a regular file is sent with sendfile() from its current offset, chunked
+ * when it exceeds MAX_CONT; anything else (pipe, tty, socket) is chunked */
+static int open_message(struct message *m, int fd, const char *name)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(name);
+        return -1;
+    }
+
+    m->fd = fd;
+    if (S_ISREG(st.st_mode)) {
+        off_t pos = lseek(fd, 0, SEEK_CUR);
+        if (pos < 0) pos = 0;
+        if (st.st_size <= pos) {
+            fprintf(stderr, "Error: no input data in %s (0 bytes)\n", name);
+            return -1;
+        }
+        m->kind    = MSG_FILE;
+        m->offset  = pos;
+        m->len     = (size_t)(st.st_size - pos);
+        m->chunked = (m->len > MAX_CONT);
+    } else {
+        m->kind    = MSG_PIPE;
+        m->chunked = TRUE;
+    }
+    return 0;
+}
+
+/* crc32c of a message body that is not a pipe. a file is read once
+ * ahead of sending it with sendfile(), which leaves it in the page cache */
+static int message_crc(const struct message *m, uint32_t *out)
+{
+    *out = 0;
+    if (m->kind == MSG_PIPE) return 0;
+    if (m->kind == MSG_MEM) {
+        *out = crc32c_update(0, m->data, m->len);
+        return 0;
+    }
+
+    unsigned char buf[FILE_CHUNK / 16];
+    off_t  off  = m->offset;
+    size_t left = m->len;
+    while (left > 0) {
+        ssize_t rn = pread(m->fd, buf, (left < sizeof(buf)) ? left : sizeof(buf), off);
+        if (rn < 0 && errno == EINTR) continue;
+        if (rn <= 0) {
+            if (rn == 0) fprintf(stderr, "Error: input file shrank while hashing\n");
+            else perror("read input");
+            return -1;
+        }
+        *out = crc32c_update(*out, buf, rn);
+        off  += rn;
+        left -= rn;
+    }
+    return 0;
+}
+
+static void sender_init(struct sender *snd, const struct message *msgs, size_t nmsg,
+                        const char *host, int keepAlive, uint32_t *crcs)
+{
+    memset(snd, 0, sizeof(*snd));
+    snd->msgs      = msgs;
+    snd->nmsg      = nmsg;
+    snd->host      = host;
+    snd->keepAlive = keepAlive;
+    snd->crcs      = crcs;
+    snd->fileFd    = -1;
+    snd->done      = (nmsg == 0);
+}
+
+/* appends as many requests as fit to the stage */
+static void sender_stage(struct sender *snd)
+{
+    snd->stageLen  = 0;
+    snd->stageSent = 0;
+
+    while (snd->next < snd->nmsg && SEND_STAGE - snd->stageLen > MAX_HDR) {
+        const struct message *m = &snd->msgs[snd->next];
+        int n;
+        if (m->chunked) {
+            n = snprintf(snd->stage + snd->stageLen, SEND_STAGE - snd->stageLen,
+                         "POST message SIMPLE/1.0\r\n"
+                         "Host: %s\r\n"
+                         CHUNKED_HDR
+                         "%s"
+                         "\r\n",
+                         snd->host, snd->keepAlive ? KEEPALIVE_HDR : "");
+        } else {
+            char crcHdr[32] = "";
+            if (snd->crcs)
+                snprintf(crcHdr, sizeof(crcHdr), CRC32C_HDR, snd->crcs[snd->next]);
+            n = snprintf(snd->stage + snd->stageLen, SEND_STAGE - snd->stageLen,
+                         "POST message SIMPLE/1.0\r\n"
+                         "Host: %s\r\n"
+                         "Content-length: %zu\r\n"
+                         "%s"
+                         "%s"
+                         "\r\n",
+                         snd->host, m->len, crcHdr, snd->keepAlive ? KEEPALIVE_HDR : "");
+        }
+        snd->stageLen += n;
+        snd->next++;
+
+        if (m->chunked) {
+            snd->stream     = m;
+            snd->streamIdx  = snd->next - 1;
+            snd->streamLeft = (m->kind == MSG_FILE) ? m->len : 0;
+            snd->fileOff    = m->offset;
+            snd->chunkOpen  = FALSE;
+            break;
+        } else if (m->kind == MSG_FILE) {
+            snd->fileFd   = m->fd;
+            snd->fileOff  = m->offset;
+            snd->fileLeft = m->len;
+            break;
+        } else if (m->len <= SEND_STAGE - snd->stageLen) {
+            memcpy(snd->stage + snd->stageLen, m->data, m->len);
+            snd->stageLen += m->len;
+        } else {
+            snd->body     = m->data;
+            snd->bodyLen  = m->len;
+            snd->bodySent = 0;
+            break;
+        }
+    }
+}
+
+/* stages the frame around the next chunk of the current chunked message,
+ * or its terminator. chunks of a file are sent with sendfile(); a pipe is
+ * read only once poll() reports it readable (see sender_on_input()) */
+static void sender_next_chunk(struct sender *snd)
+{
+    const char *crlf = snd->chunkOpen ? "\r\n" : "";
+
+    if (snd->stream->kind == MSG_PIPE) {
+        snd->needInput = TRUE;
+        return;
+    }
+
+    size_t chunk = (snd->streamLeft < FILE_CHUNK) ? snd->streamLeft : FILE_CHUNK;
+    snd->stageSent = 0;
+    if (chunk == 0) {
+        snd->stageLen = snprintf(snd->stage, SEND_STAGE, "%s" CHUNK_END, crlf);
+        snd->stream   = NULL;
+        return;
+    }
+    snd->stageLen   = snprintf(snd->stage, SEND_STAGE, "%s%zx\r\n", crlf, chunk);
+    snd->fileFd     = snd->stream->fd;
+    snd->fileLeft   = chunk;
+    snd->streamLeft -= chunk;
+    snd->chunkOpen  = TRUE;
+}
+
+/* the pipe of the current chunked message is readable: one read() becomes
+ * one chunk, framed in place in front of the data */
+static int sender_on_input(struct sender *snd)
+{
+    const char *crlf = snd->chunkOpen ? "\r\n" : "";
+    ssize_t rn;
+
+    do {
+        rn = read(snd->stream->fd, snd->stage + CHUNK_ROOM, SEND_STAGE - CHUNK_ROOM);
+    } while (rn < 0 && errno == EINTR);
+    if (rn < 0) {
+        perror("read input");
+        return -1;
+    }
+
+    snd->needInput = FALSE;
+    if (rn == 0) {
+        snd->stageLen  = snprintf(snd->stage, SEND_STAGE, "%s" CHUNK_END, crlf);
+        snd->stageSent = 0;
+        snd->stream    = NULL;
+        return 0;
+    }
+
+    if (snd->crcs)
+        snd->crcs[snd->streamIdx] = crc32c_update(snd->crcs[snd->streamIdx],
+                                                  snd->stage + CHUNK_ROOM, rn);
+
+    char frame[CHUNK_ROOM];
+    int n = snprintf(frame, sizeof(frame), "%s%zx\r\n", crlf, (size_t)rn);
+    memcpy(snd->stage + CHUNK_ROOM - n, frame, n);
+    snd->stageSent = CHUNK_ROOM - n;
+    snd->stageLen  = CHUNK_ROOM + rn;
+    snd->chunkOpen = TRUE;
+    return 0;
+}
+
+/* writes until the socket would block or more input is needed.
+ * returns -1 on a fatal error */
+static int sender_on_writable(struct sender *snd, int s)
+{
+    while (!snd->done && !snd->needInput) {
+        ssize_t wn;
+        if (snd->stageSent < snd->stageLen) {
+            wn = write(s, snd->stage + snd->stageSent, snd->stageLen - snd->stageSent);
+        } else if (snd->body && snd->bodySent < snd->bodyLen) {
+            wn = write(s, snd->body + snd->bodySent, snd->bodyLen - snd->bodySent);
+        } else if (snd->fileLeft > 0) {
+            wn = sendfile(s, snd->fileFd, &snd->fileOff, snd->fileLeft);
+            if (wn == 0) {
+                fprintf(stderr, "Error: input file shrank while sending\n");
+                return -1;
             }
-            
-            while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
-                
-                char *lower = strdup(line);
-                if (!lower) continue;
-                for (char *pp = lower; *pp; pp++)
-                    *pp = tolower((unsigned char)*pp);
-
-                
-                if (strstr(lower, "content-length:") != NULL) {
-                    
-                    char *numPtr = strchr(line, ':');
-                    if (numPtr) {
-                        numPtr++; 
-                        
-                        while (*numPtr && isspace((unsigned char)*numPtr)) numPtr++;
-                        contentLength = strtoull(numPtr, NULL, 10);
-                    }
-                }
-                free(lower);
+        } else if (snd->stream) {
+            sender_next_chunk(snd);
+            continue;
+        } else if (snd->next < snd->nmsg) {
+            snd->body = NULL;
+            sender_stage(snd);
+            continue;
+        } else {
+            snd->done = TRUE;
+            break;
+        }
+
+        if (wn < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            if (errno == EINTR) continue;
+            if (errno == EPIPE || errno == ECONNRESET) {
+                /* the server gave up on the request (e.g. 400);
+                 * whatever it sent is still read by the response side */
+                snd->done = TRUE;
+                return 0;
             }
-            free(lines);
+            perror("write request");
+            return -1;
         }
+        if (snd->stageSent < snd->stageLen)
+            snd->stageSent += wn;
+        else if (snd->body && snd->bodySent < snd->bodyLen)
+            snd->bodySent += wn;
+        else
+            snd->fileLeft -= wn;    /* sendfile() advanced fileOff itself */
+    }
+    return 0;
+}
 
-        if (is200) {
-            
-            char *bodyPos = strstr(respHeader, "\r\n\r\n");
-            size_t leftover = 0;
-            unsigned char *bodyStart = NULL;
-            if (bodyPos) {
-                bodyPos += 4; 
-                leftover = headerUsed - (bodyPos - respHeader);
-                bodyStart = (unsigned char*)bodyPos;
+static void response_init(struct response *resp, size_t expected, const uint32_t *crcs)
+{
+    rbuf_init(&resp->rb);
+    resp->expected   = expected;
+    resp->crcs       = crcs;
+    resp->nmsg       = expected;
+    resp->crc        = 0;
+    resp->inBody     = FALSE;
+    resp->chunked    = FALSE;
+    resp->chunkPhase = CHUNK_SIZE;
+    resp->remain     = 0;
+    resp->done       = (expected == 0);
+}
+
+/* consumes whatever the non-blocking socket has and copies the echoed
+ * bodies to stdout in order, decoding chunked ones. returns -1 on a fatal
+ * error, 0 otherwise. */
+static int response_on_readable(struct response *resp, int s)
+{
+    while (!resp->done) {
+        if (!resp->inBody) {
+            char  *respHeader = NULL;
+            size_t headerLen  = 0;
+            int ret = rbuf_read_header(&resp->rb, s, &respHeader, &headerLen);
+            if (ret == RBUF_AGAIN) {
+                return 0;
+            } else if (ret == RBUF_TOOLONG) {
+                fprintf(stderr, "Error: response header exceeds %d bytes\n", MAX_HDR);
+                return -1;
+            } else if (ret == RBUF_ERR) {
+                perror("read");
+                return -1;
+            } else if (ret == RBUF_EOF && resp->crcs) {
+                fprintf(stderr, "Error: no echo for message %zu\n",
+                        resp->nmsg - resp->expected + 1);
+                return -1;
+            } else if (ret == RBUF_EOF) {
+                /* connection closed mid-header: show whatever arrived */
+                write(STDOUT_FILENO, resp->rb.data + resp->rb.start, rbuf_pending(&resp->rb));
+                resp->done = TRUE;
+                return 0;
             }
 
-            
-            size_t writtenLeft = 0;
-            while (writtenLeft < leftover) {
-                ssize_t wn = write(STDOUT_FILENO, bodyStart + writtenLeft, leftover - writtenLeft);
-                if (wn < 0) {
-                    perror("write to stdout");
-                    close(s);
-                    exit(-1);
-                }
-                writtenLeft += wn;
+            struct response_info info;
+            if (parse_response_header(respHeader, headerLen, &info) < 0) {
+                fprintf(stderr, "Error: malformed response header\n");
+                return -1;
             }
 
-            
-            size_t remain = (contentLength > leftover) ? (contentLength - leftover) : 0;
+            if (!info.is200) {
+                write(STDOUT_FILENO, respHeader, headerLen);
+                write(STDOUT_FILENO, "\r\n\r\n", 4);
+                resp->done = TRUE;
+                return 0;
+            }
+            if (resp->expected > 1 && !info.keepAlive) {
+                fprintf(stderr, "Error: server closes after one message (no keep-alive)\n");
+                return -1;
+            }
 
-            
-            size_t received = 0;
-            unsigned char buf[4096];
-            while (received < remain) {
-                size_t toRead = (remain - received) > sizeof(buf) ? sizeof(buf) : (remain - received);
-                ssize_t rn = read(s, buf, toRead);
+            resp->inBody     = TRUE;
+            resp->chunked    = info.chunked;
+            resp->chunkPhase = CHUNK_SIZE;
+            resp->remain     = info.chunked ? 0 : info.contentLen;
+            resp->crc        = 0;
+        }
+
+        /* body bytes: those buffered with the header first, then straight
+         * reads that never go past the body, so a pipelined next response
+         * stays in rb */
+        while (resp->remain > 0) {
+            size_t n = rbuf_pending(&resp->rb);
+            if (n == 0) {
+                ssize_t rn = rbuf_fill(&resp->rb, s, resp->remain);
                 if (rn < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                    if (errno == EINTR) continue;
                     perror("read body");
-                    close(s);
-                    exit(-1);
+                    return -1;
                 } else if (rn == 0) {
-                    
-                    break;
-                }
-                
-                size_t written = 0;
-                while (written < (size_t)rn) {
-                    ssize_t wn = write(STDOUT_FILENO, buf + written, rn - written);
-                    if (wn < 0) {
-                        perror("write to stdout");
-                        close(s);
-                        exit(-1);
+                    /* the server cuts an echo short when the body fails
+                     * its crc32c */
+                    if (resp->crcs) {
+                        fprintf(stderr, "Error: echo of message %zu cut short\n",
+                                resp->nmsg - resp->expected + 1);
+                        return -1;
                     }
-                    written += wn;
+                    resp->done = TRUE;
+                    return 0;
                 }
-                received += rn;
+                n = rn;
             }
+            if (n > resp->remain) n = resp->remain;
+            if (write_full(STDOUT_FILENO, resp->rb.data + resp->rb.start, n) < 0) {
+                perror("write to stdout");
+                return -1;
+            }
+            if (resp->crcs)
+                resp->crc = crc32c_update(resp->crc, resp->rb.data + resp->rb.start, n);
+            rbuf_consume(&resp->rb, n);
+            resp->remain -= n;
         }
-        else {              
-            write(STDOUT_FILENO, respHeader, headerUsed);
+
+        if (resp->chunked && resp->chunkPhase != CHUNK_DONE) {
+            char  *line = NULL;
+            size_t lineLen = 0;
+            int ret = rbuf_read_line(&resp->rb, s, &line, &lineLen);
+            if (ret == RBUF_AGAIN) {
+                return 0;
+            } else if (ret == RBUF_EOF) {
+                resp->done = TRUE;
+                return 0;
+            } else if (ret != RBUF_OK) {
+                fprintf(stderr, "Error: bad chunk framing in response\n");
+                return -1;
+            }
+
+            if (resp->chunkPhase == CHUNK_SIZE) {
+                size_t size = 0;
+                if (parse_chunk_size(line, &size) < 0) {
+                    fprintf(stderr, "Error: bad chunk size in response\n");
+                    return -1;
+                }
+                resp->remain     = size;
+                resp->chunkPhase = size ? CHUNK_DATA_END : CHUNK_TRAILER;
+            } else if (resp->chunkPhase == CHUNK_DATA_END) {
+                if (lineLen != 0) {
+                    fprintf(stderr, "Error: bad chunk framing in response\n");
+                    return -1;
+                }
+                resp->chunkPhase = CHUNK_SIZE;
+            } else if (lineLen == 0) {
+                resp->chunkPhase = CHUNK_DONE;
+            }
+            continue;
         }
 
-        close(s);
-        return 0;
+        size_t idx = resp->nmsg - resp->expected;
+        if (resp->crcs && resp->crc != resp->crcs[idx]) {
+            fprintf(stderr, "Error: echo of message %zu fails its crc32c (%08x, sent %08x)\n",
+                    idx + 1, resp->crc, resp->crcs[idx]);
+            return -1;
+        }
+        resp->inBody = FALSE;
+        if (--resp->expected == 0)
+            resp->done = TRUE;
     }
+    return 0;
 }
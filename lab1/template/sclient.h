@@ -0,0 +1,21 @@
+#ifndef SCLIENT_H_
+#define SCLIENT_H_
+
+#include <stddef.h>
+
+/* load generator settings (-n -c -r -z -2) */
+struct load_config {
+    const char *server;
+    int    port;
+    long   requests;          /* total requests to complete */
+    int    concurrency;       /* connections kept open (streams with -2) */
+    double rate;              /* requests/s for open loop, 0 for closed loop */
+    const char *sizeSpec;     /* "N", "MIN-MAX" or "@file" */
+    int    simple2;           /* every request a stream on one SIMPLE/2.0 connection */
+};
+
+/* drives the server with keep-alive connections from one process and
+ * prints throughput and latency percentiles. returns the exit status */
+int  run_load(const struct load_config *cfg);
+
+#endif
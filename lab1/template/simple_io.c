@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/socket.h>
+
+#include "macro.h"
+#include "simple_io.h"
+
+void rbuf_init(struct rbuf *rb)
+{
+    rb->start = 0;
+    rb->end   = 0;
+    rb->scan  = 0;
+}
+
+/* looks for term among the buffered bytes only. on RBUF_OK hands out what
+ * precedes it, NUL-terminated; RBUF_AGAIN means more bytes are needed */
+static int rbuf_find(struct rbuf *rb, const char *term, size_t termLen,
+                     char **out, size_t *outLen)
+{
+    char *hit = memmem(rb->data + rb->scan, rb->end - rb->scan, term, termLen);
+    if (hit) {
+        size_t len = (size_t)(hit - (rb->data + rb->start));
+        if (len + termLen > MAX_HDR) {
+            return RBUF_TOOLONG;
+        }
+        *hit    = '\0';
+        *out    = rb->data + rb->start;
+        *outLen = len;
+        rb->start += len + termLen;
+        rb->scan   = rb->start;
+        return RBUF_OK;
+    }
+
+    if (rb->end - rb->start >= MAX_HDR) {
+        return RBUF_TOOLONG;
+    }
+    /* a terminator split across reads starts at most termLen-1 bytes back */
+    rb->scan = (rb->end - rb->start >= termLen - 1) ? rb->end - (termLen - 1) : rb->start;
+    return RBUF_AGAIN;
+}
+
+/* shared by the header and line readers: buffers until term shows up
+ * within MAX_HDR bytes */
+static int rbuf_read_until(struct rbuf *rb, int fd, const char *term, size_t termLen,
+                           char **out, size_t *outLen)
+{
+    while (1) {
+        int ret = rbuf_find(rb, term, termLen, out, outLen);
+        if (ret != RBUF_AGAIN) return ret;
+
+        ssize_t rn = rbuf_fill(rb, fd, RBUF_SIZE);
+        if (rn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return RBUF_AGAIN;
+            return RBUF_ERR;
+        }
+        else if (rn == 0) {
+            return RBUF_EOF;
+        }
+    }
+}
+
+int rbuf_read_header(struct rbuf *rb, int fd, char **hdr, size_t *hdrLen)
+{
+    return rbuf_read_until(rb, fd, "\r\n\r\n", 4, hdr, hdrLen);
+}
+
+int rbuf_read_line(struct rbuf *rb, int fd, char **line, size_t *lineLen)
+{
+    return rbuf_read_until(rb, fd, "\r\n", 2, line, lineLen);
+}
+
+int rbuf_find_header(struct rbuf *rb, char **hdr, size_t *hdrLen)
+{
+    return rbuf_find(rb, "\r\n\r\n", 4, hdr, hdrLen);
+}
+
+int rbuf_find_line(struct rbuf *rb, char **line, size_t *lineLen)
+{
+    return rbuf_find(rb, "\r\n", 2, line, lineLen);
+}
+
+size_t rbuf_pending(const struct rbuf *rb)
+{
+    return rb->end - rb->start;
+}
+
+size_t rbuf_take(struct rbuf *rb, void *dst, size_t max)
+{
+    size_t n = rbuf_pending(rb);
+    if (n > max) n = max;
+    memcpy(dst, rb->data + rb->start, n);
+    rbuf_consume(rb, n);
+    return n;
+}
+
+void rbuf_consume(struct rbuf *rb, size_t n)
+{
+    rb->start += n;
+    if (rb->start == rb->end) {
+        rb->start = rb->end = 0;
+    }
+    rb->scan = rb->start;
+}
+
+size_t rbuf_room(struct rbuf *rb, char **at)
+{
+    if (rb->start > 0 && rb->end == RBUF_SIZE) {
+        size_t n = rb->end - rb->start;
+        memmove(rb->data, rb->data + rb->start, n);
+        rb->scan -= rb->start;
+        rb->start = 0;
+        rb->end   = n;
+    }
+    *at = rb->data + rb->end;
+    return RBUF_SIZE - rb->end;
+}
+
+void rbuf_commit(struct rbuf *rb, size_t n)
+{
+    rb->end += n;
+}
+
+ssize_t rbuf_fill(struct rbuf *rb, int fd, size_t max)
+{
+    char *at;
+    size_t room = rbuf_room(rb, &at);
+    if (room > max) room = max;
+    ssize_t rn = read(fd, at, room);
+    if (rn > 0) rbuf_commit(rb, rn);
+    return rn;
+}
+
+int write_full(int fd, const void *buf, size_t len)
+{
+    const char *p = (const char *)buf;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t wn = write(fd, p + sent, len - sent);
+        if (wn < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        sent += wn;
+    }
+    return 0;
+}
+
+int sendv_full(int fd, struct iovec *iov, int cnt, int flags)
+{
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = cnt;
+
+    while (msg.msg_iovlen > 0) {
+        if (msg.msg_iov->iov_len == 0) {
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+            continue;
+        }
+        ssize_t wn = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+        if (wn < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (wn > 0) {
+            size_t step = ((size_t)wn < msg.msg_iov->iov_len) ? (size_t)wn : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + step;
+            msg.msg_iov->iov_len -= step;
+            wn -= step;
+            if (msg.msg_iov->iov_len == 0) {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+    return 0;
+}
+
+int parse_chunk_size(const char *line, size_t *sizeOut)
+{
+    char *endp = NULL;
+
+    if (!isxdigit((unsigned char)*line)) return -1;
+    errno = 0;
+    unsigned long long val = strtoull(line, &endp, 16);
+    if (errno == ERANGE || val > MAX_CONT) return -1;
+    /* chunk extensions (";name=value") are allowed and ignored */
+    while (*endp == ' ' || *endp == '\t') endp++;
+    if (*endp != '\0' && *endp != ';') return -1;
+
+    *sizeOut = (size_t)val;
+    return 0;
+}
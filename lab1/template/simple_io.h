@@ -0,0 +1,81 @@
+#ifndef SIMPLE_IO_H_
+#define SIMPLE_IO_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define RBUF_SIZE (4*1024)       /* bytes pulled per read() */
+
+/* return codes of rbuf_read_header() and rbuf_read_line() */
+#define RBUF_OK       0
+#define RBUF_AGAIN    1          /* non-blocking fd has no more data yet */
+#define RBUF_EOF     (-1)        /* peer closed before the terminator */
+#define RBUF_ERR     (-2)        /* read() failed, errno is set */
+#define RBUF_TOOLONG (-3)        /* no "\r\n\r\n" within MAX_HDR bytes */
+
+/* buffered reader shared by sserver and sclient.
+ * data[start, end) holds bytes read from the socket but not yet consumed.
+ * the terminator search resumes at scan, so every byte is examined once. */
+struct rbuf {
+    char   data[RBUF_SIZE + 1];
+    size_t start;
+    size_t end;
+    size_t scan;
+};
+
+void   rbuf_init(struct rbuf *rb);
+
+/* reads until a full header is buffered. on RBUF_OK, *hdr points to the
+ * NUL-terminated header (without "\r\n\r\n") inside rb, and everything after
+ * the terminator stays buffered for rbuf_take(). on a non-blocking fd,
+ * RBUF_AGAIN means call again once the fd is readable. */
+int    rbuf_read_header(struct rbuf *rb, int fd, char **hdr, size_t *hdrLen);
+
+/* same, for a single "\r\n"-terminated line such as a chunk-size line */
+int    rbuf_read_line(struct rbuf *rb, int fd, char **line, size_t *lineLen);
+
+/* the same searches over the bytes already buffered, for callers that do
+ * their own reads: RBUF_AGAIN means rbuf_commit() more bytes first */
+int    rbuf_find_header(struct rbuf *rb, char **hdr, size_t *hdrLen);
+int    rbuf_find_line(struct rbuf *rb, char **line, size_t *lineLen);
+
+/* bytes buffered past the header */
+size_t rbuf_pending(const struct rbuf *rb);
+
+/* moves up to max buffered bytes into dst, returns how many were moved */
+size_t rbuf_take(struct rbuf *rb, void *dst, size_t max);
+
+/* drops n buffered bytes */
+void   rbuf_consume(struct rbuf *rb, size_t n);
+
+/* free space at the end of rb, compacting first when the end is reached.
+ * *at is where the next bytes go; rbuf_commit() makes n of them count */
+size_t rbuf_room(struct rbuf *rb, char **at);
+void   rbuf_commit(struct rbuf *rb, size_t n);
+
+/* one read() of at most max bytes into the free space of rb.
+ * returns what read() returned */
+ssize_t rbuf_fill(struct rbuf *rb, int fd, size_t max);
+
+/* position inside a chunked body, for readers that decode it incrementally */
+enum chunk_phase {
+    CHUNK_SIZE,               /* expecting a chunk-size line */
+    CHUNK_DATA_END,           /* expecting the CRLF after chunk data */
+    CHUNK_TRAILER,            /* skipping trailer lines up to the empty one */
+    CHUNK_DONE
+};
+
+/* parses the hex size of a chunk-size line. a chunk may not exceed
+ * MAX_CONT. returns 0, or -1 when the line is malformed */
+int    parse_chunk_size(const char *line, size_t *sizeOut);
+
+/* write() until all len bytes are out. returns 0, or -1 with errno set */
+int    write_full(int fd, const void *buf, size_t len);
+
+/* sendmsg() on a socket until every byte of iov[0, cnt) is out, passing
+ * flags (e.g. MSG_MORE) on every call. iov is used up in the process.
+ * returns 0, or -1 with errno set */
+int    sendv_full(int fd, struct iovec *iov, int cnt, int flags);
+
+#endif
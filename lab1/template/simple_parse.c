@@ -0,0 +1,269 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "macro.h"
+#include "simple_parse.h"
+
+/* a piece of the header buffer: not NUL-terminated */
+struct slice {
+    const char *p;
+    size_t      len;
+};
+
+/* header fields either parser cares about */
+struct fields {
+    int    host;
+    int    contentLenSeen;
+    size_t contentLen;
+    int    keepAlive;
+    int    chunked;
+    int    crcSeen;
+    uint32_t crc;
+};
+
+#define IS_WS(c) ((c) == ' ' || (c) == '\t')
+
+static int  next_line(const char **pos, const char *end, struct slice *line);
+static int  next_token(struct slice *line, struct slice *tok);
+static int  slice_is(const struct slice *s, const char *lit);
+static int  slice_is_nocase(const struct slice *s, const char *lit);
+static int  has_token(struct slice value, const char *lit);
+static int  parse_decimal(const struct slice *s, size_t *out);
+static int  parse_crc(const struct slice *s, uint32_t *out);
+static int  parse_fields(const char *pos, const char *end, struct fields *f);
+
+int parse_request_header(const char *hdr, size_t hdrLen, struct request_info *req)
+{
+    const char *pos = hdr;
+    const char *end = hdr + hdrLen;
+    struct slice line, method, target, version, extra;
+
+    /* "POST message SIMPLE/1.0" */
+    if (next_line(&pos, end, &line) < 0
+        || next_token(&line, &method) < 0
+        || next_token(&line, &target) < 0
+        || next_token(&line, &version) < 0
+        || next_token(&line, &extra) == 0) {
+        return -1;
+    }
+    if (!slice_is(&method, "POST")
+        || !slice_is_nocase(&target, "message")
+        || !slice_is_nocase(&version, "SIMPLE/1.0")) {
+        return -1;
+    }
+
+    struct fields f;
+    if (parse_fields(pos, end, &f) < 0) {
+        return -1;
+    }
+
+    /* exactly one of Content-length and chunked framing delimits the body */
+    if (!f.host || f.contentLenSeen == f.chunked) {
+        return -1;
+    }
+    req->contentLen = f.contentLen;
+    req->keepAlive  = f.keepAlive;
+    req->chunked    = f.chunked;
+    req->hasCrc     = f.crcSeen;
+    req->crc        = f.crc;
+    return 0;
+}
+
+int parse_response_header(const char *hdr, size_t hdrLen, struct response_info *resp)
+{
+    const char *pos = hdr;
+    const char *end = hdr + hdrLen;
+    struct slice line, version, status;
+
+    /* "SIMPLE/1.0 200 OK"; the reason phrase is not checked */
+    if (next_line(&pos, end, &line) < 0
+        || next_token(&line, &version) < 0
+        || next_token(&line, &status) < 0
+        || !slice_is_nocase(&version, "SIMPLE/1.0")) {
+        return -1;
+    }
+
+    struct fields f;
+    if (parse_fields(pos, end, &f) < 0) {
+        return -1;
+    }
+    resp->is200      = slice_is(&status, "200");
+    resp->contentLen = f.contentLen;
+    resp->keepAlive  = f.keepAlive;
+    resp->chunked    = f.chunked;
+    return 0;
+}
+
+void frame_encode(const struct frame_header *fh, unsigned char *out)
+{
+    out[0] = fh->stream >> 24;
+    out[1] = fh->stream >> 16;
+    out[2] = fh->stream >> 8;
+    out[3] = fh->stream;
+    out[4] = fh->flags >> 8;
+    out[5] = fh->flags;
+    out[6] = fh->len >> 8;
+    out[7] = fh->len;
+}
+
+int frame_decode(const unsigned char *in, struct frame_header *fh)
+{
+    fh->stream = (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16
+               | (uint32_t)in[2] << 8 | in[3];
+    fh->flags  = (uint16_t)(in[4] << 8 | in[5]);
+    fh->len    = (uint16_t)(in[6] << 8 | in[7]);
+
+    if (fh->stream == 0 || (fh->flags & ~FRAME_END) || fh->len > FRAME_MAX) return -1;
+    return 0;
+}
+
+/* the line at *pos, without its "\r\n" (a bare "\n" is accepted too).
+ * returns -1 once the header is used up */
+static int next_line(const char **pos, const char *end, struct slice *line)
+{
+    if (*pos >= end) return -1;
+
+    const char *nl = memchr(*pos, '\n', end - *pos);
+    const char *stop = nl ? nl : end;
+
+    line->p   = *pos;
+    line->len = stop - *pos;
+    if (line->len > 0 && line->p[line->len - 1] == '\r') line->len--;
+
+    *pos = nl ? nl + 1 : end;
+    return 0;
+}
+
+/* cuts the next blank-separated token off the front of line */
+static int next_token(struct slice *line, struct slice *tok)
+{
+    const char *p   = line->p;
+    const char *end = line->p + line->len;
+
+    while (p < end && IS_WS(*p)) p++;
+    if (p == end) return -1;
+
+    tok->p = p;
+    while (p < end && !IS_WS(*p)) p++;
+    tok->len = p - tok->p;
+
+    line->len = end - p;
+    line->p   = p;
+    return 0;
+}
+
+static int slice_is(const struct slice *s, const char *lit)
+{
+    size_t n = strlen(lit);
+    return s->len == n && memcmp(s->p, lit, n) == 0;
+}
+
+static int slice_is_nocase(const struct slice *s, const char *lit)
+{
+    size_t n = strlen(lit);
+    return s->len == n && strncasecmp(s->p, lit, n) == 0;
+}
+
+/* whether a comma-separated list such as "keep-alive, Upgrade" holds lit */
+static int has_token(struct slice value, const char *lit)
+{
+    const char *p   = value.p;
+    const char *end = value.p + value.len;
+
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        const char *stop  = comma ? comma : end;
+        struct slice tok = { p, stop - p };
+
+        while (tok.len > 0 && IS_WS(tok.p[0])) { tok.p++; tok.len--; }
+        while (tok.len > 0 && IS_WS(tok.p[tok.len - 1])) tok.len--;
+        if (slice_is_nocase(&tok, lit)) return TRUE;
+
+        p = comma ? comma + 1 : end;
+    }
+    return FALSE;
+}
+
+/* digits only, checked by strtoull for overflow. the slice is not
+ * NUL-terminated, so it goes through a small stack copy */
+static int parse_decimal(const struct slice *s, size_t *out)
+{
+    char digits[24];
+    char *endp = NULL;
+
+    if (s->len == 0 || s->len >= sizeof(digits)) return -1;
+    for (size_t k = 0; k < s->len; k++)
+        if (s->p[k] < '0' || s->p[k] > '9') return -1;
+    memcpy(digits, s->p, s->len);
+    digits[s->len] = '\0';
+
+    errno = 0;
+    unsigned long long val = strtoull(digits, &endp, 10);
+    if (errno == ERANGE || *endp != '\0' || val > (size_t)-1) return -1;
+
+    *out = (size_t)val;
+    return 0;
+}
+
+/* 1 to 8 hex digits */
+static int parse_crc(const struct slice *s, uint32_t *out)
+{
+    uint32_t val = 0;
+
+    if (s->len == 0 || s->len > 8) return -1;
+    for (size_t k = 0; k < s->len; k++) {
+        char ch = s->p[k];
+        int d = (ch >= '0' && ch <= '9') ? ch - '0'
+              : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10
+              : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : -1;
+        if (d < 0) return -1;
+        val = val << 4 | d;
+    }
+    *out = val;
+    return 0;
+}
+
+/* "Name: value" lines up to end. names are compared in place without
+ * regard to case; values lose their surrounding blanks */
+static int parse_fields(const char *pos, const char *end, struct fields *f)
+{
+    struct slice line;
+
+    memset(f, 0, sizeof(*f));
+    while (next_line(&pos, end, &line) == 0) {
+        if (line.len == 0) continue;
+
+        const char *colon = memchr(line.p, ':', line.len);
+        if (!colon || colon == line.p) return -1;
+
+        struct slice name  = { line.p, colon - line.p };
+        struct slice value = { colon + 1, line.len - (name.len + 1) };
+        if (IS_WS(name.p[name.len - 1])) return -1;
+        while (value.len > 0 && IS_WS(value.p[0])) { value.p++; value.len--; }
+        while (value.len > 0 && IS_WS(value.p[value.len - 1])) value.len--;
+
+        if (slice_is_nocase(&name, "host")) {
+            f->host = TRUE;
+        }
+        else if (slice_is_nocase(&name, "content-length")) {
+            size_t len = 0;
+            if (parse_decimal(&value, &len) < 0) return -1;
+            if (f->contentLenSeen && len != f->contentLen) return -1;
+            f->contentLenSeen = TRUE;
+            f->contentLen     = len;
+        }
+        else if (slice_is_nocase(&name, "connection")) {
+            f->keepAlive = has_token(value, "keep-alive");
+        }
+        else if (slice_is_nocase(&name, "transfer-encoding")) {
+            f->chunked = has_token(value, "chunked");
+        }
+        else if (slice_is_nocase(&name, "content-crc32c")) {
+            if (parse_crc(&value, &f->crc) < 0) return -1;
+            f->crcSeen = TRUE;
+        }
+    }
+    return 0;
+}
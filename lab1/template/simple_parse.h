@@ -0,0 +1,55 @@
+#ifndef SIMPLE_PARSE_H_
+#define SIMPLE_PARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* what parse_request_header() extracts from a request header */
+struct request_info {
+    size_t contentLen;        /* unused when chunked */
+    int    keepAlive;         /* "Connection: keep-alive" */
+    int    chunked;           /* "Transfer-encoding: chunked" */
+    int    hasCrc;            /* "Content-crc32c" */
+    uint32_t crc;
+};
+
+/* what parse_response_header() extracts from a response header */
+struct response_info {
+    int    is200;             /* status line is "SIMPLE/1.0 200 ..." */
+    size_t contentLen;        /* 0 when absent */
+    int    keepAlive;
+    int    chunked;
+};
+
+/* single-pass parsers shared by sserver and sclient. they walk
+ * hdr[0, hdrLen) (the header without its "\r\n\r\n") once, in place:
+ * nothing is copied, allocated or written, and field names are matched
+ * case-insensitively on the original bytes. a line without a colon, a
+ * Content-length that is not a plain decimal number, that overflows, or
+ * that is repeated with another value, or a Content-crc32c that is not
+ * 1 to 8 hex digits makes the header malformed.
+ * return 0, or -1 when the header is malformed */
+int parse_request_header(const char *hdr, size_t hdrLen, struct request_info *req);
+int parse_response_header(const char *hdr, size_t hdrLen, struct response_info *resp);
+
+/* SIMPLE/2.0 frame header: stream id (32 bits), flags (16) and payload
+ * length (16), big-endian, FRAME_HDR_LEN bytes in front of the payload.
+ * a message is the payloads of one stream up to the frame flagged
+ * FRAME_END; frames of different streams may interleave freely. a stream
+ * id is nonzero and may be used again once its echo has ended */
+#define FRAME_HDR_LEN 8
+#define FRAME_MAX     (16*1024)  /* largest payload of one frame */
+#define FRAME_END     0x0001
+
+struct frame_header {
+    uint32_t stream;
+    uint16_t flags;
+    uint16_t len;
+};
+
+void frame_encode(const struct frame_header *fh, unsigned char *out);
+
+/* returns 0, or -1 for stream 0, unknown flags or len > FRAME_MAX */
+int  frame_decode(const unsigned char *in, struct frame_header *fh);
+
+#endif
@@ -0,0 +1,776 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "macro.h"
+#include "simple_io.h"
+#include "simple_parse.h"
+#include "sclient.h"
+#include "lhist.h"
+
+#define MAX_EVENTS 256
+#define DRAIN_BUF  (64*1024)
+#define MUX_BATCH  32             /* frames per writev() with -2 */
+
+/* request bodies: slices of one buffer, chosen per request */
+struct payloads {
+    unsigned char *data;
+    size_t lo, hi;            /* uniform size range (lo == hi: fixed) */
+    size_t *off, *len;        /* @file: one slice per line */
+    size_t  count;
+    size_t  next;
+    uint64_t rng;
+};
+
+/* one keep-alive connection with at most one request in flight, or with
+ * -2 one stream of the shared connection (fd unused) */
+struct lconn {
+    int fd;
+    int busy;
+    uint32_t events;
+    uint32_t stream;          /* -2: stream id */
+
+    char   hdr[256];
+    struct iovec iov[2];      /* request header and body still to write */
+    size_t bodyLen;
+
+    struct rbuf rb;
+    int    inBody;
+    size_t remain;
+    int    closing;           /* the echo came without keep-alive */
+    uint64_t startNs;         /* intended (open loop) or actual send time */
+};
+
+/* -2: every request is a stream on one SIMPLE/2.0 connection. request
+ * bodies are cut into frames of at most FRAME_MAX bytes, sent round robin
+ * over the streams that still have bytes to go, so a large body does not
+ * hold up the small ones behind it; echoed frames find their stream by id */
+struct mux {
+    int fd;
+    uint32_t events;
+    struct rbuf rb;
+
+    struct lconn **sendq;     /* ring of streams with frames left to send */
+    int qhead, qlen, qcap;
+    unsigned char hdrs[MUX_BATCH][FRAME_HDR_LEN];
+    struct iovec iov[2 * MUX_BATCH];
+    int iovCnt, iovDone;      /* iov[iovDone, iovCnt) is still to write */
+
+    struct lconn *rx;         /* stream of the frame being received */
+    size_t rxLeft;
+    int    rxEnd;
+};
+
+struct load_state {
+    const struct load_config *cfg;
+    struct sockaddr_in saddr;
+    int epfd;
+    struct lconn *conns;
+    struct lconn **idle;
+    int nidle;
+    int nconn;
+    struct mux mux;
+    struct payloads pl;
+    struct lhist hist;
+    long completed;
+    long errors;
+    uint64_t bytes;
+};
+
+static uint64_t now_ns(void);
+static int  payloads_init(struct payloads *pl, const char *spec);
+static void payloads_pick(struct payloads *pl, const unsigned char **body, size_t *len);
+static int  lconn_open(struct load_state *ls, struct lconn *c);
+static int  lconn_start(struct load_state *ls, struct lconn *c, uint64_t startNs);
+static int  lconn_on_event(struct load_state *ls, struct lconn *c);
+static void lconn_finish(struct load_state *ls, struct lconn *c, int ok);
+static int  lconn_want(struct load_state *ls, struct lconn *c, uint32_t events);
+static int  mux_open(struct load_state *ls);
+static int  mux_start(struct load_state *ls, struct lconn *c, uint64_t startNs);
+static int  mux_flush(struct load_state *ls);
+static int  mux_on_event(struct load_state *ls);
+static void mux_fail(struct load_state *ls);
+
+/*--------------------------------------------------------------------------------*/
+int run_load(const struct load_config *cfg)
+{
+    static struct load_state ls;
+    ls.cfg = cfg;
+    lhist_init(&ls.hist);
+
+    if (payloads_init(&ls.pl, cfg->sizeSpec) < 0) {
+        return -1;
+    }
+
+    memset(&ls.saddr, 0, sizeof(ls.saddr));
+    ls.saddr.sin_family = AF_INET;
+    ls.saddr.sin_port   = htons(cfg->port);
+    if (inet_pton(AF_INET, cfg->server, &ls.saddr.sin_addr) <= 0) {
+        fprintf(stderr, "Invalid server IP address.\n");
+        return -1;
+    }
+
+    ls.epfd = epoll_create1(0);
+    if (ls.epfd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    int nconn = cfg->concurrency;
+    if (nconn > cfg->requests) nconn = (int)cfg->requests;
+    ls.conns = (struct lconn *)calloc(nconn, sizeof(*ls.conns));
+    ls.idle  = (struct lconn **)calloc(nconn, sizeof(*ls.idle));
+    if (!ls.conns || !ls.idle) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    ls.nconn = nconn;
+    if (cfg->simple2) {
+        ls.mux.qcap  = nconn;
+        ls.mux.sendq = (struct lconn **)calloc(nconn, sizeof(*ls.mux.sendq));
+        if (!ls.mux.sendq) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        if (mux_open(&ls) < 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < nconn; i++) {
+        if (cfg->simple2) {
+            ls.conns[i].fd = -1;
+            ls.conns[i].stream = i + 1;
+        }
+        else if (lconn_open(&ls, &ls.conns[i]) < 0) {
+            return -1;
+        }
+        ls.idle[ls.nidle++] = &ls.conns[i];
+    }
+
+    /* open loop: request i is due at t0 + i/rate no matter how the server
+     * is doing. a request that finds every connection busy waits for one,
+     * and its latency still counts from the due time, so a stalled server
+     * cannot hide the queueing it causes (coordinated omission). */
+    const uint64_t t0 = now_ns();
+    const double intervalNs = (cfg->rate > 0) ? 1e9 / cfg->rate : 0;
+    long issued = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (ls.completed + ls.errors < cfg->requests) {
+        uint64_t now;
+        while (issued < cfg->requests && ls.nidle > 0) {
+            /* closed loop: a request can finish inside lconn_start(), so
+             * the next one is timed from a fresh clock reading */
+            uint64_t due = now = now_ns();
+            if (intervalNs > 0) {
+                due = t0 + (uint64_t)(issued * intervalNs);
+                if (due > now) break;
+            }
+            struct lconn *c = ls.idle[--ls.nidle];
+            if ((cfg->simple2 ? mux_start(&ls, c, due) : lconn_start(&ls, c, due)) < 0) {
+                return -1;
+            }
+            issued++;
+        }
+
+        /* a fast echo can complete inside lconn_start() */
+        if (ls.completed + ls.errors >= cfg->requests) break;
+
+        int timeout = -1;
+        if (intervalNs > 0 && issued < cfg->requests && ls.nidle > 0) {
+            uint64_t due = t0 + (uint64_t)(issued * intervalNs);
+            now = now_ns();
+            timeout = (due > now) ? (int)((due - now + 999999) / 1000000) : 0;
+        }
+
+        int n = epoll_wait(ls.epfd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            struct lconn *c = (struct lconn *)events[i].data.ptr;
+            if ((cfg->simple2 ? mux_on_event(&ls) : lconn_on_event(&ls, c)) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    double elapsed = (double)(now_ns() - t0) / 1e9;
+    if (cfg->simple2) {
+        printf("requests     %ld (%ld errors), %d streams on one SIMPLE/2.0 connection, %s\n",
+               ls.completed, ls.errors, nconn,
+               (intervalNs > 0) ? "open loop" : "closed loop");
+    } else {
+        printf("requests     %ld (%ld errors), %d connections, %s\n",
+               ls.completed, ls.errors, nconn,
+               (intervalNs > 0) ? "open loop" : "closed loop");
+    }
+    if (intervalNs > 0) {
+        printf("target rate  %.1f req/s (latency measured from the intended send time)\n",
+               cfg->rate);
+    }
+    printf("elapsed      %.3f s\n", elapsed);
+    printf("throughput   %.1f req/s, %.2f MB/s echoed\n",
+           ls.completed / elapsed, (double)ls.bytes / elapsed / (1024 * 1024));
+    printf("latency us   mean %.1f  p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+           ls.hist.count ? (double)ls.hist.sum / ls.hist.count : 0.0,
+           (unsigned long long)lhist_percentile(&ls.hist, 50),
+           (unsigned long long)lhist_percentile(&ls.hist, 99),
+           (unsigned long long)lhist_percentile(&ls.hist, 99.9),
+           (unsigned long long)ls.hist.max);
+
+    for (int i = 0; i < nconn; i++)
+        if (ls.conns[i].fd >= 0) close(ls.conns[i].fd);
+    if (cfg->simple2) {
+        close(ls.mux.fd);
+        free(ls.mux.sendq);
+    }
+    free(ls.conns);
+    free(ls.idle);
+    close(ls.epfd);
+    return (ls.errors == 0) ? 0 : 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* "N" fixed size, "MIN-MAX" uniform sizes, "@file" one body per line,
+ * "=file" the whole file as every body */
+static int payloads_init(struct payloads *pl, const char *spec)
+{
+    memset(pl, 0, sizeof(*pl));
+    pl->rng = 0x9e3779b97f4a7c15ull;
+
+    if (spec[0] == '@' || spec[0] == '=') {
+        FILE *fp = fopen(spec + 1, "rb");
+        if (!fp) {
+            perror(spec + 1);
+            return -1;
+        }
+        pl->data = (unsigned char *)malloc(MAX_CONT);
+        if (!pl->data) {
+            fprintf(stderr, "Memory allocation failed\n");
+            fclose(fp);
+            return -1;
+        }
+        size_t total = fread(pl->data, 1, MAX_CONT, fp);
+        fclose(fp);
+        if (total == 0) {
+            fprintf(stderr, "Error: %s is empty\n", spec + 1);
+            return -1;
+        }
+
+        int whole = (spec[0] == '=');
+        size_t cap = 1;
+        for (size_t k = 0; k < total && !whole; k++)
+            if (pl->data[k] == '\n') cap++;
+        pl->off = (size_t *)calloc(cap, sizeof(size_t));
+        pl->len = (size_t *)calloc(cap, sizeof(size_t));
+        if (!pl->off || !pl->len) {
+            fprintf(stderr, "Memory allocation failed\n");
+            return -1;
+        }
+        size_t from = 0;
+        for (size_t k = 0; k < total; k++) {
+            if ((pl->data[k] == '\n' && !whole) || k + 1 == total) {
+                pl->off[pl->count] = from;
+                pl->len[pl->count] = k + 1 - from;
+                pl->count++;
+                from = k + 1;
+            }
+        }
+        return 0;
+    }
+
+    char *endp = NULL;
+    pl->lo = pl->hi = strtoull(spec, &endp, 10);
+    if (*endp == '-') {
+        pl->hi = strtoull(endp + 1, &endp, 10);
+    }
+    if (*endp != '\0' || pl->lo == 0 || pl->hi < pl->lo || pl->hi > MAX_CONT) {
+        fprintf(stderr, "Error: bad size \"%s\" (N, MIN-MAX, @file or =file, 1..%d bytes)\n",
+                spec, MAX_CONT);
+        return -1;
+    }
+
+    pl->data = (unsigned char *)malloc(pl->hi);
+    if (!pl->data) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return -1;
+    }
+    for (size_t k = 0; k < pl->hi; k++)
+        pl->data[k] = 'a' + k % 26;
+    return 0;
+}
+
+static void payloads_pick(struct payloads *pl, const unsigned char **body, size_t *len)
+{
+    if (pl->count > 0) {
+        size_t i = pl->next++ % pl->count;
+        *body = pl->data + pl->off[i];
+        *len  = pl->len[i];
+        return;
+    }
+
+    *body = pl->data;
+    *len  = pl->lo;
+    if (pl->hi > pl->lo) {
+        /* xorshift64 */
+        pl->rng ^= pl->rng << 13;
+        pl->rng ^= pl->rng >> 7;
+        pl->rng ^= pl->rng << 17;
+        *len += pl->rng % (pl->hi - pl->lo + 1);
+    }
+}
+
+static int lconn_open(struct load_state *ls, struct lconn *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (c->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(c->fd, (struct sockaddr *)&ls->saddr, sizeof(ls->saddr)) < 0) {
+        perror("connect");
+        close(c->fd);
+        return -1;
+    }
+    int flags = fcntl(c->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(c->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(c->fd);
+        return -1;
+    }
+    rbuf_init(&c->rb);
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = c->events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(ls->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        perror("epoll_ctl add");
+        close(c->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static int lconn_want(struct load_state *ls, struct lconn *c, uint32_t events)
+{
+    if (c->events == events) return 0;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(ls->epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl mod");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+static int lconn_start(struct load_state *ls, struct lconn *c, uint64_t startNs)
+{
+    const unsigned char *body;
+    size_t len;
+    payloads_pick(&ls->pl, &body, &len);
+
+    int n = snprintf(c->hdr, sizeof(c->hdr),
+                     "POST message SIMPLE/1.0\r\n"
+                     "Host: %s\r\n"
+                     "Content-length: %zu\r\n"
+                     KEEPALIVE_HDR
+                     "\r\n",
+                     ls->cfg->server, len);
+    c->iov[0].iov_base = c->hdr;
+    c->iov[0].iov_len  = (size_t)n;
+    c->iov[1].iov_base = (void *)body;
+    c->iov[1].iov_len  = len;
+    c->bodyLen = len;
+    c->busy    = TRUE;
+    c->inBody  = FALSE;
+    c->startNs = startNs;
+
+    /* the write is attempted right away; EPOLLOUT only if it blocks */
+    return lconn_on_event(ls, c);
+}
+
+/* writes what is left of the request, then reads what the response has.
+ * returns -1 only when the run cannot go on */
+static int lconn_on_event(struct load_state *ls, struct lconn *c)
+{
+    static unsigned char drain[DRAIN_BUF];
+
+    if (!c->busy) {
+        /* an idle keep-alive connection only wakes up when closed */
+        lconn_finish(ls, c, FALSE);
+        return 0;
+    }
+
+    while (c->iov[0].iov_len + c->iov[1].iov_len > 0) {
+        ssize_t wn = writev(c->fd, c->iov, 2);
+        if (wn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            lconn_finish(ls, c, FALSE);
+            return 0;
+        }
+        for (int k = 0; k < 2; k++) {
+            size_t step = ((size_t)wn < c->iov[k].iov_len) ? (size_t)wn : c->iov[k].iov_len;
+            c->iov[k].iov_base = (char *)c->iov[k].iov_base + step;
+            c->iov[k].iov_len -= step;
+            wn -= step;
+        }
+    }
+    int writing = (c->iov[0].iov_len + c->iov[1].iov_len > 0);
+    if (lconn_want(ls, c, EPOLLIN | (writing ? EPOLLOUT : 0)) < 0) {
+        return -1;
+    }
+
+    if (!c->inBody) {
+        char  *respHeader = NULL;
+        size_t headerLen  = 0;
+        int ret = rbuf_read_header(&c->rb, c->fd, &respHeader, &headerLen);
+        if (ret == RBUF_AGAIN) return 0;
+        if (ret != RBUF_OK) {
+            lconn_finish(ls, c, FALSE);
+            return 0;
+        }
+
+        struct response_info info;
+        if (parse_response_header(respHeader, headerLen, &info) < 0
+            || !info.is200 || info.chunked
+            || info.contentLen != c->bodyLen) {
+            lconn_finish(ls, c, FALSE);
+            return 0;
+        }
+        c->inBody  = TRUE;
+        c->closing = !info.keepAlive;
+        c->remain = info.contentLen;
+
+        size_t buffered = rbuf_pending(&c->rb);
+        if (buffered > c->remain) buffered = c->remain;
+        rbuf_consume(&c->rb, buffered);
+        c->remain -= buffered;
+    }
+
+    while (c->remain > 0) {
+        size_t want = (c->remain < sizeof(drain)) ? c->remain : sizeof(drain);
+        ssize_t rn = read(c->fd, drain, want);
+        if (rn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            lconn_finish(ls, c, FALSE);
+            return 0;
+        }
+        else if (rn == 0) {
+            lconn_finish(ls, c, FALSE);
+            return 0;
+        }
+        c->remain -= rn;
+    }
+
+    if (writing) {
+        /* the whole echo arrived before the request was written out */
+        lconn_finish(ls, c, FALSE);
+        return 0;
+    }
+    lconn_finish(ls, c, TRUE);
+    return 0;
+}
+
+/* records a completed request, or counts an error and replaces the
+ * connection, then hands the connection back to the idle pool */
+static void lconn_finish(struct load_state *ls, struct lconn *c, int ok)
+{
+    if (ok) {
+        uint64_t now = now_ns();
+        lhist_record(&ls->hist, (now > c->startNs) ? (now - c->startNs) / 1000 : 0);
+        ls->completed++;
+        ls->bytes += c->bodyLen;
+        c->busy   = FALSE;
+        c->inBody = FALSE;
+
+        /* a server that is restarting or retiring the worker answers
+         * without keep-alive: the request counts, the connection is
+         * replaced */
+        if (c->closing) {
+            close(c->fd);
+            if (lconn_open(ls, c) < 0) {
+                fprintf(stderr, "Error: cannot reconnect\n");
+                exit(-1);
+            }
+        }
+    }
+    else {
+        int wasBusy = c->busy;
+        close(c->fd);
+        if (lconn_open(ls, c) < 0) {
+            fprintf(stderr, "Error: cannot reconnect\n");
+            exit(-1);
+        }
+        if (!wasBusy) return;     /* already in the idle pool */
+        ls->errors++;
+    }
+    ls->idle[ls->nidle++] = c;
+}
+
+/* connects and exchanges the SIMPLE/2.0 preface, blocking, before the
+ * socket joins the epoll set */
+static int mux_open(struct load_state *ls)
+{
+    struct mux *m = &ls->mux;
+
+    m->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (m->fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(m->fd, (struct sockaddr *)&ls->saddr, sizeof(ls->saddr)) < 0) {
+        perror("connect");
+        close(m->fd);
+        return -1;
+    }
+    rbuf_init(&m->rb);
+
+    char  *preface = NULL;
+    size_t prefaceLen = 0;
+    if (write_full(m->fd, SIMPLE2_PREFACE, strlen(SIMPLE2_PREFACE)) < 0
+        || rbuf_read_header(&m->rb, m->fd, &preface, &prefaceLen) != RBUF_OK
+        || strcmp(preface, SIMPLE2_VERSION) != 0) {
+        fprintf(stderr, "Error: server does not speak %s\n", SIMPLE2_VERSION);
+        close(m->fd);
+        return -1;
+    }
+
+    int flags = fcntl(m->fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(m->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(m->fd);
+        return -1;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = m->events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ls->epfd, EPOLL_CTL_ADD, m->fd, &ev) < 0) {
+        perror("epoll_ctl add");
+        close(m->fd);
+        return -1;
+    }
+    m->qhead = m->qlen = 0;
+    m->iovCnt = m->iovDone = 0;
+    m->rx = NULL;
+    return 0;
+}
+
+static int mux_start(struct load_state *ls, struct lconn *c, uint64_t startNs)
+{
+    struct mux *m = &ls->mux;
+    const unsigned char *body;
+    size_t len;
+    payloads_pick(&ls->pl, &body, &len);
+
+    c->iov[1].iov_base = (void *)body;
+    c->iov[1].iov_len  = len;
+    c->bodyLen = len;
+    c->remain  = len;
+    c->busy    = TRUE;
+    c->startNs = startNs;
+
+    m->sendq[(m->qhead + m->qlen++) % m->qcap] = c;
+    return mux_flush(ls);
+}
+
+/* writes frames until the socket would block: one frame per queued
+ * stream in turn, MUX_BATCH of them per writev() */
+static int mux_flush(struct load_state *ls)
+{
+    struct mux *m = &ls->mux;
+
+    while (1) {
+        if (m->iovDone == m->iovCnt) {
+            m->iovCnt = m->iovDone = 0;
+            for (int k = 0; k < MUX_BATCH && m->qlen > 0; k++) {
+                struct lconn *c = m->sendq[m->qhead];
+                m->qhead = (m->qhead + 1) % m->qcap;
+                m->qlen--;
+
+                struct frame_header fh;
+                size_t left = c->iov[1].iov_len;
+                fh.stream = c->stream;
+                fh.len    = (left < FRAME_MAX) ? left : FRAME_MAX;
+                fh.flags  = (fh.len == left) ? FRAME_END : 0;
+                frame_encode(&fh, m->hdrs[k]);
+
+                m->iov[m->iovCnt].iov_base = m->hdrs[k];
+                m->iov[m->iovCnt].iov_len  = FRAME_HDR_LEN;
+                m->iovCnt++;
+                if (fh.len > 0) {
+                    m->iov[m->iovCnt].iov_base = c->iov[1].iov_base;
+                    m->iov[m->iovCnt].iov_len  = fh.len;
+                    m->iovCnt++;
+                }
+                c->iov[1].iov_base = (char *)c->iov[1].iov_base + fh.len;
+                c->iov[1].iov_len -= fh.len;
+
+                /* back in line for its next frame */
+                if (!(fh.flags & FRAME_END))
+                    m->sendq[(m->qhead + m->qlen++) % m->qcap] = c;
+            }
+            if (m->iovCnt == 0) break;
+        }
+
+        ssize_t wn = writev(m->fd, m->iov + m->iovDone, m->iovCnt - m->iovDone);
+        if (wn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            mux_fail(ls);
+            return 0;
+        }
+        while (wn > 0) {
+            struct iovec *v = &m->iov[m->iovDone];
+            size_t step = ((size_t)wn < v->iov_len) ? (size_t)wn : v->iov_len;
+            v->iov_base = (char *)v->iov_base + step;
+            v->iov_len -= step;
+            wn -= step;
+            if (v->iov_len == 0) m->iovDone++;
+        }
+    }
+
+    uint32_t events = EPOLLIN | ((m->iovDone < m->iovCnt) ? EPOLLOUT : 0);
+    if (m->events != events) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = events;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(ls->epfd, EPOLL_CTL_MOD, m->fd, &ev) < 0) {
+            perror("epoll_ctl mod");
+            return -1;
+        }
+        m->events = events;
+    }
+    return 0;
+}
+
+/* sends what it can, then takes echoed frames apart: a stream is done
+ * once its FRAME_END frame is in and every byte has come back */
+static int mux_on_event(struct load_state *ls)
+{
+    static unsigned char drain[DRAIN_BUF];
+    struct mux *m = &ls->mux;
+
+    if (mux_flush(ls) < 0) return -1;
+
+    while (1) {
+        if (m->rx && m->rxLeft > 0) {
+            size_t buffered = rbuf_pending(&m->rb);
+            if (buffered > m->rxLeft) buffered = m->rxLeft;
+            rbuf_consume(&m->rb, buffered);
+            m->rxLeft     -= buffered;
+            m->rx->remain -= buffered;
+            if (m->rxLeft == 0) continue;
+
+            size_t want = (m->rxLeft < sizeof(drain)) ? m->rxLeft : sizeof(drain);
+            ssize_t rn = read(m->fd, drain, want);
+            if (rn < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                mux_fail(ls);
+                return 0;
+            }
+            else if (rn == 0) {
+                mux_fail(ls);
+                return 0;
+            }
+            m->rxLeft     -= rn;
+            m->rx->remain -= rn;
+            continue;
+        }
+
+        if (m->rx) {
+            struct lconn *c = m->rx;
+            m->rx = NULL;
+            if (m->rxEnd) {
+                if (c->remain != 0) {
+                    mux_fail(ls);
+                    return 0;
+                }
+                uint64_t now = now_ns();
+                lhist_record(&ls->hist, (now > c->startNs) ? (now - c->startNs) / 1000 : 0);
+                ls->completed++;
+                ls->bytes += c->bodyLen;
+                c->busy = FALSE;
+                ls->idle[ls->nidle++] = c;
+            }
+            continue;
+        }
+
+        if (rbuf_pending(&m->rb) < FRAME_HDR_LEN) {
+            ssize_t rn = rbuf_fill(&m->rb, m->fd, RBUF_SIZE);
+            if (rn < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+                mux_fail(ls);
+                return 0;
+            }
+            else if (rn == 0) {
+                mux_fail(ls);
+                return 0;
+            }
+            continue;
+        }
+
+        struct frame_header fh;
+        if (frame_decode((unsigned char *)m->rb.data + m->rb.start, &fh) < 0
+            || fh.stream > (uint32_t)ls->nconn
+            || !ls->conns[fh.stream - 1].busy
+            || fh.len > ls->conns[fh.stream - 1].remain) {
+            mux_fail(ls);
+            return 0;
+        }
+        rbuf_consume(&m->rb, FRAME_HDR_LEN);
+        m->rx     = &ls->conns[fh.stream - 1];
+        m->rxLeft = fh.len;
+        m->rxEnd  = fh.flags & FRAME_END;
+    }
+}
+
+/* the shared connection broke: every stream in flight counts as an error
+ * and goes back to the idle pool, and a new connection replaces it */
+static void mux_fail(struct load_state *ls)
+{
+    close(ls->mux.fd);
+    for (int i = 0; i < ls->nconn; i++) {
+        struct lconn *c = &ls->conns[i];
+        if (!c->busy) continue;
+        c->busy = FALSE;
+        ls->errors++;
+        ls->idle[ls->nidle++] = c;
+    }
+    if (mux_open(ls) < 0) {
+        fprintf(stderr, "Error: cannot reconnect\n");
+        exit(-1);
+    }
+}
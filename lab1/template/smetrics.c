@@ -0,0 +1,71 @@
+#include <string.h>
+#include <time.h>
+
+#include "smetrics.h"
+
+void metrics_init(struct worker_metrics *m)
+{
+    memset(m, 0, sizeof(*m));
+    lhist_init(&m->parseNs);
+    lhist_init(&m->bodyUs);
+    lhist_init(&m->echoUs);
+}
+
+void metrics_merge(struct worker_metrics *dst, const struct worker_metrics *src)
+{
+    dst->accepted    += src->accepted;
+    dst->ok          += src->ok;
+    dst->bad         += src->bad;
+    dst->unavailable += src->unavailable;
+    dst->frames      += src->frames;
+    dst->corrupt     += src->corrupt;
+    dst->zcSends     += src->zcSends;
+    dst->zcCopied    += src->zcCopied;
+    dst->bytesIn     += src->bytesIn;
+    dst->bytesOut    += src->bytesOut;
+    lhist_merge(&dst->parseNs, &src->parseNs);
+    lhist_merge(&dst->bodyUs, &src->bodyUs);
+    lhist_merge(&dst->echoUs, &src->echoUs);
+}
+
+void metrics_snapshot(const struct metrics *mt, struct worker_metrics *out)
+{
+    metrics_init(out);
+    for (uint32_t k = 0; k < mt->slots; k++)
+        metrics_merge(out, &mt->w[k]);
+}
+
+static void print_hist(FILE *fp, const char *name, const char *unit, const struct lhist *h)
+{
+    fprintf(fp, "%-12s %s  n %llu  mean %.1f  p50 %llu  p99 %llu  p99.9 %llu  max %llu\n",
+            name, unit, (unsigned long long)h->count,
+            h->count ? (double)h->sum / h->count : 0.0,
+            (unsigned long long)lhist_percentile(h, 50),
+            (unsigned long long)lhist_percentile(h, 99),
+            (unsigned long long)lhist_percentile(h, 99.9),
+            (unsigned long long)(h->count ? h->max : 0));
+}
+
+void metrics_print(FILE *fp, const struct worker_metrics *m)
+{
+    fprintf(fp, "accepted %llu, responses %llu 200, %llu 400, %llu 503, %llu frames,"
+            " %llu failed crc32c\n",
+            (unsigned long long)m->accepted, (unsigned long long)m->ok,
+            (unsigned long long)m->bad, (unsigned long long)m->unavailable,
+            (unsigned long long)m->frames, (unsigned long long)m->corrupt);
+    fprintf(fp, "bytes in %llu, out %llu\n",
+            (unsigned long long)m->bytesIn, (unsigned long long)m->bytesOut);
+    if (m->zcSends > 0)
+        fprintf(fp, "zerocopy sends %llu, %llu of them copied by the kernel\n",
+                (unsigned long long)m->zcSends, (unsigned long long)m->zcCopied);
+    print_hist(fp, "header parse", "ns", &m->parseNs);
+    print_hist(fp, "body receive", "us", &m->bodyUs);
+    print_hist(fp, "echo", "us", &m->echoUs);
+}
+
+uint64_t metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,50 @@
+#ifndef SMETRICS_H_
+#define SMETRICS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "lhist.h"
+
+/* sserver metrics, in a POSIX shared memory segment named after the port
+ * (METRICS_NAME) that sstat maps read-only. every worker owns one block
+ * and is its only writer, so counters are plain increments with no locks
+ * or atomics; blocks are cache-line aligned so workers never share a
+ * line. the parent unlinks the segment when it stops */
+#define METRICS_NAME  "/sserver.%d"
+#define METRICS_MAGIC 0x534d4554u     /* "SMET" */
+
+struct worker_metrics {
+    uint64_t accepted;
+    uint64_t ok;                /* 200 responses */
+    uint64_t bad;               /* 400 responses */
+    uint64_t unavailable;       /* 503 responses */
+    uint64_t frames;            /* SIMPLE/2.0 frames echoed */
+    uint64_t corrupt;           /* bodies failing their Content-crc32c */
+    uint64_t zcSends;           /* MSG_ZEROCOPY sends (-Z) */
+    uint64_t zcCopied;          /* of those, copied by the kernel after all */
+    uint64_t bytesIn;           /* headers and bodies, without framing */
+    uint64_t bytesOut;
+    struct lhist parseNs;       /* parse_request_header(), ns */
+    struct lhist bodyUs;        /* header parsed -> last body byte read, us */
+    struct lhist echoUs;        /* header parsed -> last echo byte sent, us */
+} __attribute__((aligned(64)));
+
+struct metrics {
+    uint32_t magic;
+    uint32_t slots;
+    pid_t    pid;               /* the parent */
+    struct worker_metrics w[];
+};
+
+void     metrics_init(struct worker_metrics *m);
+void     metrics_merge(struct worker_metrics *dst, const struct worker_metrics *src);
+
+/* one block holding the sum of all slots */
+void     metrics_snapshot(const struct metrics *mt, struct worker_metrics *out);
+void     metrics_print(FILE *fp, const struct worker_metrics *m);
+
+uint64_t metrics_now_ns(void);
+
+#endif
@@ -11,16 +11,212 @@
 #include <arpa/inet.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 #include "macro.h"
+#include "sserver.h"
+#include "simple_io.h"
+#include "smetrics.h"
+#include "crc32c.h"
 
-static void handle_connection(int connfd);
-static int  parse_request_header(
-    char *headerBuf,
-    size_t headerLen,
-    size_t *contentLenOut
-);
-static void send_400_response(int connfd);
+#define RELAY_CHUNK (64*1024)    /* bytes moved per splice()/read() */
+#define KEEPALIVE_TIMEOUT_MS 5000 /* idle time allowed between requests */
+
+#define POOL_LIMIT 256            /* most workers -W may ask for */
+#define MAINTAIN_MS 1000          /* the parent checks the pool this often */
+#define MAX_SPAWN_RATE 32         /* most workers started per check */
+
+#define GOV_WAIT_MS 50            /* how long a body waits for a full window */
+#define GOV_SMALL_WINDOW 4096     /* the window it settles for after that */
+
+#define CONNQ_SIZE 64             /* accepted connections waiting for a thread */
+#define PARKED_SIZE 1024          /* -t: idle keep-alive connections the acceptor watches */
+
+#define ZC_BUFS 4                 /* MSG_ZEROCOPY buffers in flight per relay */
+#define ZC_MIN_CHUNK (16*1024)    /* smaller sends are not worth pinning pages */
+
+/* restart (SIGHUP): what the old parent hands to the new one across exec */
+#define LISTEN_FDS_ENV "SSERVER_LISTEN_FDS"   /* listening sockets, "3,4,..." */
+#define DRAIN_PIDS_ENV "SSERVER_DRAIN_PIDS"   /* old workers to drain */
+#define DRAIN_TIMEOUT_MS 30000    /* old workers still running after this are killed */
+
+/* a prefork request goes through these phases, each with its own
+ * deadline (-T). a connection that misses one is closed */
+enum conn_phase { PHASE_HEADER, PHASE_BODY, PHASE_WRITE, NUM_PHASES };
+
+/* scoreboard slot, in memory shared by the parent and all workers */
+enum slot_state { SLOT_IDLE, SLOT_BUSY };
+struct worker_slot {
+    volatile int  state;          /* written by the worker */
+    unsigned long killed[NUM_PHASES];
+    long          held;           /* bytes reserved from the governor */
+};
+
+/* memory governor (-G): a byte budget shared by every prefork worker.
+ * bodies are relayed cut-through, so what a connection pins is its relay
+ * window, the most body bytes it has in the splice pipe or the copy
+ * buffer at once. the window is reserved here before the relay starts */
+struct governor {
+    long          budget;         /* 0: no limit */
+    volatile long inUse;
+    unsigned long granted;        /* full windows */
+    unsigned long waited;         /* of those, after waiting for room */
+    unsigned long shrunk;         /* served through a GOV_SMALL_WINDOW */
+    unsigned long rejected;       /* answered with 503 */
+};
+
+/* what only the parent knows about a slot */
+struct worker {
+    pid_t pid;                    /* 0: slot is empty */
+    int   cpu;                    /* -1: not pinned */
+    int   retiring;               /* SIGTERM sent by the pool, no respawn */
+    int   respawn;                /* died unexpectedly, refill next check */
+};
+
+/* how workers are started and how many of them the pool keeps */
+struct pool_config {
+    int epollMode;
+    int uringMode;
+    int threads;                  /* -t: one worker process with this many threads */
+    int reusePort;
+    int adaptive;                 /* only plain prefork grows and shrinks */
+    int startWorkers;
+    int minSpare;
+    int maxSpare;
+    int maxWorkers;
+};
+
+/* a connection served by a prefork worker. the socket is non-blocking and
+ * every wait goes through conn_wait(), which enforces the deadline of the
+ * phase being waited in. reads count against the header or body deadline,
+ * each send against a write deadline of its own, so a client that stops
+ * reading its echo is caught as well as one that trickles its request */
+struct conn {
+    int         fd;
+    struct rbuf rb;
+    int         readPhase;        /* PHASE_HEADER or PHASE_BODY */
+    long long   deadline[NUM_PHASES]; /* CLOCK_MONOTONIC ms, 0: none */
+    int         expired;          /* phase that timed out, -1 if none */
+    size_t      window;           /* most body bytes relayed at once */
+    size_t      reserved;         /* of that, taken from the governor */
+    size_t      bodyBytes;        /* body echoed for the current request */
+    uint64_t    bodyDoneNs;       /* when its last byte was read */
+    int         crcCheck;         /* the body carries a Content-crc32c */
+    uint32_t    crc;              /* of the body bytes read so far */
+    uint32_t    crcWant;
+    int         zerocopy;         /* SO_ZEROCOPY: 0 not tried, 1 on, -1 refused */
+    uint32_t    zcNext;           /* sequence number of the next zerocopy send */
+    uint32_t    zcDone;           /* every send before this one has completed */
+};
+
+/* -t: bounded queue from the acceptor to the connection threads. any
+ * number of threads may push or pop; a full queue stalls the acceptor,
+ * which leaves further connections in the kernel's listen backlog.
+ * a thread idling on a keep-alive connection while more connections are
+ * queued than threads wait for them parks it instead: the acceptor
+ * watches parked connections and queues each again once its next
+ * request arrives */
+struct conn_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t  notEmpty;
+    pthread_cond_t  notFull;
+    int             fds[CONNQ_SIZE];
+    unsigned char   kept[CONNQ_SIZE]; /* parked between requests before */
+    unsigned        head;         /* next fd to pop */
+    unsigned        count;
+    int             idle;         /* threads waiting in connq_pop() */
+    int             busy;         /* eventfd, readable while count > idle */
+    int             busySet;
+    int             parked[PARKED_SIZE];
+    long long       parkedUntil[PARKED_SIZE]; /* its keep-alive deadline */
+    int             numParked;
+    int             parkWake;     /* eventfd: the acceptor has a new one to watch */
+};
+
+static int  open_listener(int port, int reusePort);
+static int  inherit_listeners(void);
+static void drain_old_workers(const char *pids);
+static void reexec(void);
+static struct metrics *open_metrics(int port);
+static int  pick_cpu(int c);
+static void spawn_worker(int k);
+static void run_prefork_worker(int listenfd);
+static void run_thread_worker(int listenfd);
+static void *connection_thread(void *arg);
+static void connq_push(struct conn_queue *q, int fd, int kept);
+static int  connq_pop(struct conn_queue *q, int *kept);
+static void connq_update(struct conn_queue *q);
+static int  connq_park(struct conn_queue *q, int fd, long long until);
+static void watch_parked(struct conn_queue *q, int listenfd);
+static void reap_workers(void);
+static void maintain_pool(void);
+static void report_pool(void);
+static void on_parent_signal(int sig);
+static void on_worker_term(int sig);
+static void set_worker_term(void);
+static int  handle_connection(int connfd, int kept);
+static void serve_frames(struct conn *c);
+static int  conn_idle(struct conn *c, int mayHandBack);
+static long long now_ms(void);
+static void conn_start_phase(struct conn *c, int phase);
+static int  conn_wait(struct conn *c, short events);
+static int  conn_read(struct conn *c,
+                      int (*reader)(struct rbuf *, int, char **, size_t *),
+                      char **out, size_t *outLen);
+static int  conn_send(struct conn *c, struct iovec *iov, int cnt, int flags);
+static int  gov_take(long n);
+static int  gov_reserve(struct conn *c, size_t want);
+static void gov_release(struct conn *c);
+static int  relay_from(struct conn *c, size_t len, const char *prefix, size_t prefixLen);
+static int  relay_chunked(struct conn *c, const char *head, size_t headLen);
+static int  send_prefixed(struct conn *c, const char *prefix, size_t prefixLen,
+                          const void *data, size_t len, int more);
+static int  relay_body(struct conn *c, size_t remain);
+static int  relay_body_copy(struct conn *c, size_t remain);
+static int  relay_body_zc(struct conn *c, size_t remain);
+static int  zc_reap(struct conn *c, uint32_t until);
+static void send_error_response(struct conn *c, int code);
+static int  conn_check_crc(struct conn *c);
+
+__thread struct worker_metrics *g_metrics;
+int g_coalesce = TRUE;
+int g_nodelay  = TRUE;
+static struct worker_slot *g_scoreboard;
+static struct governor *g_gov;
+static struct metrics *g_shm;
+static char g_shmName[32];
+static struct worker g_workers[POOL_LIMIT];
+static struct pool_config g_pool;
+static int g_listenfds[POOL_LIMIT];
+static int g_numListenfds;
+static int g_spawnRate = 1;
+static size_t g_zcThreshold;            /* -Z: 0 for never */
+static int g_phaseMs[NUM_PHASES] = { 10000, 60000, 10000 };
+static const char *g_phaseNames[NUM_PHASES] = { "header", "body", "write" };
+static __thread struct worker_slot *g_slot; /* this worker's (or thread's) slot */
+
+static volatile sig_atomic_t g_reportRequested;
+static volatile sig_atomic_t g_stopRequested;
+static volatile sig_atomic_t g_reloadRequested;
+static const char **g_argv;
+static pid_t g_oldWorkers[POOL_LIMIT];  /* the previous generation, draining */
+static int g_numOld;
+static long long g_drainUntil;
+volatile sig_atomic_t g_retire;         /* worker: exit after this connection */
+static struct conn_queue g_connq = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .notEmpty = PTHREAD_COND_INITIALIZER,
+    .notFull = PTHREAD_COND_INITIALIZER, .busy = -1, .parkWake = -1
+};
 
 /*--------------------------------------------------------------------------------*/
 int 
@@ -28,16 +224,67 @@ main(const int argc, const char** argv)
 {
     int i;
     int port = -1;
+    long budgetKB = 8192;
+    struct pool_config *pool = &g_pool;
+
+    g_argv = argv;
+    pool->minSpare   = 2;
+    pool->maxSpare   = 10;
+    pool->maxWorkers = 64;
 
     /* argument parsing */
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
             port = atoi(argv[i+1]);
             i++;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            pool->epollMode = TRUE;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            pool->uringMode = TRUE;
+        } else if (strcmp(argv[i], "-R") == 0) {
+            pool->reusePort = TRUE;
+        } else if (strcmp(argv[i], "-L") == 0) {
+            g_coalesce = FALSE;
+        } else if (strcmp(argv[i], "-N") == 0) {
+            g_nodelay = FALSE;
+        } else if (strcmp(argv[i], "-t") == 0 && (i+1) < argc) {
+            pool->threads = atoi(argv[i+1]);
+            if (pool->threads < 1) port = -1;
+            i++;
+        } else if (strcmp(argv[i], "-w") == 0 && (i+1) < argc) {
+            pool->startWorkers = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-m") == 0 && (i+1) < argc) {
+            pool->minSpare = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-M") == 0 && (i+1) < argc) {
+            pool->maxSpare = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-W") == 0 && (i+1) < argc) {
+            pool->maxWorkers = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-G") == 0 && (i+1) < argc) {
+            budgetKB = atol(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-Z") == 0 && (i+1) < argc) {
+            g_zcThreshold = strtoul(argv[i+1], NULL, 10);
+            i++;
+        } else if (strcmp(argv[i], "-T") == 0 && (i+1) < argc) {
+            if (sscanf(argv[i+1], "%d,%d,%d", &g_phaseMs[PHASE_HEADER],
+                       &g_phaseMs[PHASE_BODY], &g_phaseMs[PHASE_WRITE]) != 3) {
+                port = -1;
+                break;
+            }
+            i++;
         }
     }
-    if (port <= 0 || port > 65535) {
-        printf("usage: %s -p port\n", argv[0]);
+    if (port <= 0 || port > 65535 || budgetKB < 0
+        || g_phaseMs[PHASE_HEADER] < 0 || g_phaseMs[PHASE_BODY] < 0
+        || g_phaseMs[PHASE_WRITE] < 0) {
+        printf("usage: %s -p port [-e | -u | -t threads] [-R] [-w workers]"
+               " [-m min-spare] [-M max-spare] [-W max-workers] [-L] [-N]"
+               " [-T header-ms,body-ms,write-ms] [-G budget-kb] [-Z zerocopy-bytes]\n",
+               argv[0]);
         exit(-1);
     }
 
@@ -46,295 +293,1412 @@ main(const int argc, const char** argv)
 
         signal(SIGPIPE, SIG_IGN);
 
-        int s;
-        struct sockaddr_in saddr;
-        memset(&saddr, 0, sizeof(saddr));
+        /* io_uring (-u) falls back to epoll where the kernel lacks it */
+        if (pool->uringMode && !uring_supported()) {
+            fprintf(stderr, "io_uring unavailable, using epoll instead\n");
+            pool->uringMode = FALSE;
+            pool->epollMode = TRUE;
+        }
+
+        /* prefork: 5 blocking children to start with. epoll (-e), io_uring
+         * (-u) and reuseport (-R): one worker per online CPU, a fixed pool
+         * since every worker serves its own share of the connections. -w
+         * overrides either default */
+        pool->adaptive = !pool->epollMode && !pool->uringMode && !pool->reusePort;
 
-        s = socket(AF_INET, SOCK_STREAM, 0);
-        if (s < 0) {
-            perror("socket");
+        /* -t: a single worker process whose threads take the place of the
+         * prefork children, so they share one address space. every thread
+         * gets its own scoreboard slot and metrics block */
+        if (pool->threads) {
+            if (pool->epollMode || pool->uringMode || pool->reusePort
+                || pool->threads > POOL_LIMIT) {
+                printf("-t takes 1 to %d threads and does not combine with -e, -u or -R.\n",
+                       POOL_LIMIT);
+                exit(-1);
+            }
+            pool->adaptive = FALSE;
+            pool->startWorkers = 1;
+        }
+        if (pool->startWorkers == 0) {
+            pool->startWorkers = 5;
+            if (!pool->adaptive) {
+                long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+                pool->startWorkers = (ncpu > 0) ? (int)ncpu : 1;
+            }
+        }
+        if (!pool->adaptive) pool->maxWorkers = pool->startWorkers;
+        if (pool->maxWorkers > POOL_LIMIT) pool->maxWorkers = POOL_LIMIT;
+        if (pool->startWorkers < 1 || pool->startWorkers > pool->maxWorkers
+            || pool->minSpare < 1 || pool->maxSpare < pool->minSpare) {
+            printf("need 1 <= workers <= max-workers (<= %d) and 1 <= min-spare <= max-spare.\n",
+                   POOL_LIMIT);
             exit(-1);
         }
 
-        int optval = 1;
-        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
-
-        saddr.sin_family      = AF_INET;
-        saddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        saddr.sin_port        = htons(port);
+        /* -R: every worker gets its own SO_REUSEPORT socket, so the kernel
+         * spreads connections over per-worker accept queues instead of
+         * waking several workers on one. the parent opens them all up
+         * front and keeps them, so a bind failure is reported before
+         * anything forks and a respawned worker picks up its queue */
+        g_numListenfds = pool->reusePort ? pool->startWorkers : 1;
+        for (int c = inherit_listeners(); c < g_numListenfds; c++) {
+            g_listenfds[c] = open_listener(port, pool->reusePort);
+            if (g_listenfds[c] < 0) exit(-1);
+        }
 
-        if (bind(s, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
-            perror("bind");
-            close(s);
+        g_scoreboard = (struct worker_slot *)mmap(NULL, POOL_LIMIT * sizeof(struct worker_slot),
+                                                  PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (g_scoreboard == MAP_FAILED) {
+            perror("mmap scoreboard");
             exit(-1);
         }
-
-        if (listen(s, 128) < 0) {
-            perror("listen");
-            close(s);
+        g_gov = (struct governor *)mmap(NULL, sizeof(struct governor),
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (g_gov == MAP_FAILED) {
+            perror("mmap governor");
             exit(-1);
         }
+        g_gov->budget = budgetKB * 1024;
 
-        int num_children = 5;
-        for (int c = 0; c < num_children; c++) {
-            pid_t pid = fork();
-            if (pid < 0) {
-                perror("fork");
-                close(s);
-                exit(-1);
-            } 
-            else if (pid == 0) {
-                while (1) {
-                    struct sockaddr_in cliaddr;
-                    socklen_t clilen = sizeof(cliaddr);
-                    int connfd = accept(s, (struct sockaddr *)&cliaddr, &clilen);
-                    if (connfd < 0) {
-                        perror("accept");
-                        continue;
-                    }
-
-                    handle_connection(connfd);
-
-                    close(connfd);
-                }
-                exit(0);
-            }
+        g_shm = open_metrics(port);
+        if (g_shm == NULL) exit(-1);
+
+        /* SIGUSR1 prints the scoreboard, SIGINT/SIGTERM print it and stop
+         * the workers, SIGHUP restarts. no SA_RESTART, so the maintenance
+         * sleep returns */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_parent_signal;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGUSR1, &sa, NULL);
+        sigaction(SIGHUP,  &sa, NULL);
+        sigaction(SIGINT,  &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        for (int k = 0; k < POOL_LIMIT; k++)
+            g_workers[k].cpu = (pool->reusePort && k < pool->startWorkers) ? pick_cpu(k) : -1;
+        for (int k = 0; k < pool->startWorkers; k++)
+            spawn_worker(k);
+
+        /* after a restart, the new workers are up: the old ones stop
+         * accepting and finish what they have */
+        const char *oldPids = getenv(DRAIN_PIDS_ENV);
+        if (oldPids) {
+            drain_old_workers(oldPids);
+            unsetenv(DRAIN_PIDS_ENV);
         }
 
-        while (1) {
-            int status = 0;
-            pid_t w = waitpid(-1, &status, 0);
-            if (w < 0) {
-                if (errno == EINTR) continue;
-                perror("waitpid");
-                break;
+        while (!g_stopRequested) {
+            if (g_reportRequested) {
+                g_reportRequested = 0;
+                report_pool();
+            }
+            if (g_reloadRequested) {
+                g_reloadRequested = 0;
+                reexec();
+            }
+            poll(NULL, 0, MAINTAIN_MS);
+            reap_workers();
+            maintain_pool();
+
+            if (g_numOld > 0 && now_ms() >= g_drainUntil) {
+                fprintf(stderr, "killing %d old workers still draining after %d ms\n",
+                        g_numOld, DRAIN_TIMEOUT_MS);
+                for (int k = 0; k < g_numOld; k++)
+                    kill(g_oldWorkers[k], SIGKILL);
+                g_numOld = 0;
             }
         }
 
-        close(s);
+        for (int k = 0; k < POOL_LIMIT; k++)
+            if (g_workers[k].pid > 0) kill(g_workers[k].pid, SIGTERM);
+        report_pool();
+
+        for (int c = 0; c < g_numListenfds; c++)
+            close(g_listenfds[c]);
+        if (g_shmName[0]) shm_unlink(g_shmName);
         return 0;
     }
 }
 
-static void handle_connection(int connfd)
+static int open_listener(int port, int reusePort)
 {
+    struct sockaddr_in saddr;
+    memset(&saddr, 0, sizeof(saddr));
 
-    char headerBuf[MAX_HDR + 1];
-    memset(headerBuf, 0, sizeof(headerBuf));
-    size_t used = 0;
-    int headerComplete = 0;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0) {
+        perror("socket");
+        return -1;
+    }
 
-    while (!headerComplete) {
-        if (used >= MAX_HDR) {
-            send_400_response(connfd);
-            return;
+    int optval = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval));
+    if (reusePort && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        perror("setsockopt SO_REUSEPORT");
+        close(s);
+        return -1;
+    }
+
+    saddr.sin_family      = AF_INET;
+    saddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    saddr.sin_port        = htons(port);
+
+    if (bind(s, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+        perror("bind");
+        close(s);
+        return -1;
+    }
+
+    if (listen(s, 128) < 0) {
+        perror("listen");
+        close(s);
+        return -1;
+    }
+    return s;
+}
+
+/* listening sockets left open by the parent this one was exec'd from,
+ * in place of new ones. returns how many g_listenfds it filled */
+static int inherit_listeners(void)
+{
+    const char *list = getenv(LISTEN_FDS_ENV);
+    int n = 0;
+
+    if (!list) return 0;
+    for (const char *p = list; *p; ) {
+        char *end;
+        long fd = strtol(p, &end, 10);
+        if (end == p) break;
+        if (n < g_numListenfds) g_listenfds[n++] = (int)fd;
+        else close((int)fd);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    return n;
+}
+
+/* SIGTERMs the previous generation and remembers it for reap_workers()
+ * and the DRAIN_TIMEOUT_MS kill */
+static void drain_old_workers(const char *pids)
+{
+    for (const char *p = pids; *p && g_numOld < POOL_LIMIT; ) {
+        char *end;
+        long pid = strtol(p, &end, 10);
+        if (end == p) break;
+        if (pid > 0 && kill((pid_t)pid, SIGTERM) == 0)
+            g_oldWorkers[g_numOld++] = (pid_t)pid;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    g_drainUntil = now_ms() + DRAIN_TIMEOUT_MS;
+}
+
+/* SIGHUP: replaces this parent with a fresh exec of the same command line,
+ * under the same pid. the listening sockets stay open across exec, so the
+ * kernel keeps queueing connections and none is refused; the workers keep
+ * running and accepting until the new parent has started its own, then
+ * drain. if exec fails, nothing has changed */
+static void reexec(void)
+{
+    char fds[POOL_LIMIT * 12];
+    char pids[POOL_LIMIT * 2 * 12];
+    size_t n = 0;
+
+    fds[0] = pids[0] = '\0';
+    for (int c = 0; c < g_numListenfds; c++)
+        n += snprintf(fds + n, sizeof(fds) - n, "%s%d", c ? "," : "", g_listenfds[c]);
+    n = 0;
+    for (int k = 0; k < POOL_LIMIT; k++)
+        if (g_workers[k].pid > 0)
+            n += snprintf(pids + n, sizeof(pids) - n, "%s%d", n ? "," : "", (int)g_workers[k].pid);
+    for (int k = 0; k < g_numOld; k++)
+        n += snprintf(pids + n, sizeof(pids) - n, "%s%d", n ? "," : "", (int)g_oldWorkers[k]);
+
+    fprintf(stderr, "restarting: %s\n", g_argv[0]);
+    setenv(LISTEN_FDS_ENV, fds, 1);
+    setenv(DRAIN_PIDS_ENV, pids, 1);
+    execvp(g_argv[0], (char *const *)g_argv);
+
+    perror("execvp");
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(DRAIN_PIDS_ENV);
+}
+
+/* the metrics segment, named after the port so sstat can find it. where
+ * shared memory cannot be named, the workers still count into an
+ * anonymous mapping, which only SIGUSR1 can report. a segment left by an
+ * earlier generation is unlinked rather than truncated, since its
+ * draining workers still write to it */
+static struct metrics *open_metrics(int port)
+{
+    size_t size = sizeof(struct metrics) + POOL_LIMIT * sizeof(struct worker_metrics);
+    struct metrics *mt = MAP_FAILED;
+
+    snprintf(g_shmName, sizeof(g_shmName), METRICS_NAME, port);
+    shm_unlink(g_shmName);
+    int fd = shm_open(g_shmName, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0 && ftruncate(fd, size) == 0) {
+        mt = (struct metrics *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0) close(fd);
+    if (mt == MAP_FAILED) {
+        perror("shm_open metrics");
+        if (fd >= 0) shm_unlink(g_shmName);
+        g_shmName[0] = '\0';
+        mt = (struct metrics *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mt == MAP_FAILED) {
+            perror("mmap metrics");
+            return NULL;
         }
-        ssize_t rn = read(connfd, headerBuf + used, 1);
-        if (rn < 0) {
-            perror("read");
-            send_400_response(connfd);
-            return;
-        } 
-        else if (rn == 0) {
-            send_400_response(connfd);
-            return;
+    }
+
+    for (int k = 0; k < POOL_LIMIT; k++)
+        metrics_init(&mt->w[k]);
+    mt->slots = POOL_LIMIT;
+    mt->pid   = getpid();
+    mt->magic = METRICS_MAGIC;
+    return mt;
+}
+
+/* the CPU for worker c: the c-th CPU this process may run on, wrapping
+ * around, so taskset and cpusets are respected */
+static int pick_cpu(int c)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    int n = CPU_COUNT(&allowed);
+    if (n == 0) return -1;
+
+    int want = c % n;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && want-- == 0) return cpu;
+    }
+    return -1;
+}
+
+/* forks the worker for slot k. it counts as idle until it reports in */
+static void spawn_worker(int k)
+{
+    struct worker *w = &g_workers[k];
+
+    g_scoreboard[k].state = SLOT_IDLE;
+    w->retiring = FALSE;
+    w->respawn  = FALSE;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        w->respawn = TRUE;
+        return;
+    }
+    if (pid > 0) {
+        w->pid = pid;
+        return;
+    }
+
+    int s = g_listenfds[g_pool.reusePort ? k : 0];
+    for (int c = 0; c < g_numListenfds; c++)
+        if (g_listenfds[c] != s) close(g_listenfds[c]);
+    g_slot = &g_scoreboard[k];
+    g_metrics = &g_shm->w[k];
+
+    signal(SIGINT,  SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGHUP,  SIG_DFL);
+    set_worker_term();
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            perror("sched_setaffinity");
+    }
+
+    if (g_pool.threads) {
+        run_thread_worker(s);
+        exit(0);
+    }
+    if (g_pool.uringMode && run_uring_worker(s) < 0) {
+        fprintf(stderr, "worker %d: io_uring setup failed, using epoll\n", k);
+    }
+    if (g_pool.epollMode || g_pool.uringMode) {
+        run_epoll_worker(s);
+        exit(0);
+    }
+    run_prefork_worker(s);
+    exit(0);
+}
+
+/* blocking accept loop. SIGTERM lets the current connection finish */
+static void run_prefork_worker(int listenfd)
+{
+    while (!g_retire) {
+        g_slot->state = SLOT_IDLE;
+
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen);
+        if (connfd < 0) {
+            if (errno != EINTR) perror("accept");
+            continue;
         }
-        used += rn;
+        g_slot->state = SLOT_BUSY;
+        g_metrics->accepted++;
+        apply_tcp_policy(connfd);
+
+        handle_connection(connfd, FALSE);
+
+        close(connfd);
+    }
+}
+
+/* -t: the worker's main thread accepts and queues connections, each of
+ * the threads serves one at a time with handle_connection(), just like a
+ * prefork child, except that it parks an idle keep-alive connection when
+ * others are waiting (see struct conn_queue). SIGTERM is only delivered
+ * to the main thread: it stops accepting and queues one -1 per thread
+ * behind the connections still waiting, so every thread finishes those
+ * first */
+static void run_thread_worker(int listenfd)
+{
+    pthread_t tids[POOL_LIMIT];
+    sigset_t term, old;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+
+    g_connq.busy     = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    g_connq.parkWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_connq.busy < 0 || g_connq.parkWake < 0) {
+        perror("eventfd");
+        exit(-1);
+    }
 
-        if (used >= 4 && strstr(headerBuf, "\r\n\r\n") != NULL) {
-            headerComplete = 1;
+    pthread_sigmask(SIG_BLOCK, &term, &old);
+    for (long t = 0; t < g_pool.threads; t++) {
+        int err = pthread_create(&tids[t], NULL, connection_thread, (void *)t);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(-1);
         }
     }
-    headerBuf[used] = '\0';
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-    char *pos = strstr(headerBuf, "\r\n\r\n");
-    if (!pos) {
-        send_400_response(connfd);
-        return;
+    watch_parked(&g_connq, listenfd);
+
+    for (int t = 0; t < g_pool.threads; t++)
+        connq_push(&g_connq, -1, FALSE);
+    for (int t = 0; t < g_pool.threads; t++)
+        pthread_join(tids[t], NULL);
+}
+
+/* the acceptor: waits for a new connection or for the next request on a
+ * parked one, and queues either. a parked connection past its keep-alive
+ * deadline is closed. on SIGTERM the parked ones with a request on the
+ * way are queued one last time and the others closed */
+static void watch_parked(struct conn_queue *q, int listenfd)
+{
+    static struct pollfd pfd[2 + PARKED_SIZE];
+    static int ready[PARKED_SIZE];
+    pfd[0].fd     = listenfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd     = q->parkWake;
+    pfd[1].events = POLLIN;
+
+    while (1) {
+        long long now = now_ms(), first = 0;
+        pthread_mutex_lock(&q->lock);
+        int n = q->numParked;
+        for (int k = 0; k < n; k++) {
+            pfd[2 + k].fd     = q->parked[k];
+            pfd[2 + k].events = POLLIN;
+            if (first == 0 || q->parkedUntil[k] < first) first = q->parkedUntil[k];
+        }
+        pthread_mutex_unlock(&q->lock);
+
+        int timeout = (n == 0) ? -1 : (first > now) ? (int)(first - now) : 0;
+        if (g_retire) timeout = 0;
+        int pn = poll(pfd, 2 + n, timeout);
+        if (pn < 0) {
+            if (errno != EINTR) perror("poll");
+            for (int k = 0; k < 2 + n; k++) pfd[k].revents = 0;
+        }
+
+        if (pfd[1].revents) {
+            uint64_t v;
+            if (read(q->parkWake, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("read eventfd");
+        }
+
+        /* the n that were polled are still the first n: threads only
+         * append, and only this loop removes */
+        now = now_ms();
+        int numReady = 0, keep = 0;
+        pthread_mutex_lock(&q->lock);
+        for (int k = 0; k < q->numParked; k++) {
+            int fd = q->parked[k];
+            if (k < n && pfd[2 + k].revents) {
+                ready[numReady++] = fd;
+            } else if (k < n && pn >= 0 && (q->parkedUntil[k] <= now || g_retire)) {
+                close(fd);
+            } else {
+                q->parked[keep]      = fd;
+                q->parkedUntil[keep] = q->parkedUntil[k];
+                keep++;
+            }
+        }
+        q->numParked = keep;
+        pthread_mutex_unlock(&q->lock);
+        for (int k = 0; k < numReady; k++)
+            connq_push(q, ready[k], TRUE);
+
+        /* on SIGTERM, once more with a poll that was not cut short */
+        if (g_retire && pn >= 0) break;
+        if (!pfd[0].revents) continue;
+
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+        int connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen);
+        if (connfd < 0) {
+            if (errno != EINTR) perror("accept");
+            continue;
+        }
+        apply_tcp_policy(connfd);
+        connq_push(q, connfd, FALSE);
     }
-    pos += 4;  
-    size_t headerConsumed = (size_t)(pos - headerBuf); 
-    size_t leftover = used - headerConsumed;
+}
 
-    size_t headerLen = headerConsumed - 4; 
-    if (headerLen > MAX_HDR) {
-        send_400_response(connfd);
-        return;
+static void *connection_thread(void *arg)
+{
+    long t = (long)arg;
+    g_slot    = &g_scoreboard[t];
+    g_metrics = &g_shm->w[t];
+
+    while (1) {
+        g_slot->state = SLOT_IDLE;
+        int kept = FALSE;
+        int connfd = connq_pop(&g_connq, &kept);
+        if (connfd < 0) break;
+        g_slot->state = SLOT_BUSY;
+        if (!kept) g_metrics->accepted++;
+
+        if (handle_connection(connfd, kept)) continue;   /* parked */
+
+        close(connfd);
     }
+    return NULL;
+}
 
-    char headerCopy[MAX_HDR + 1];
-    memcpy(headerCopy, headerBuf, headerLen);
-    headerCopy[headerLen] = '\0';
+/* keeps q->busy readable exactly while more connections are queued than
+ * threads wait for them */
+static void connq_update(struct conn_queue *q)
+{
+    uint64_t v = 1;
+    int busy = (q->count > (unsigned)q->idle);
+    if (busy && !q->busySet) {
+        if (write(q->busy, &v, sizeof(v)) < 0) perror("write eventfd");
+    } else if (!busy && q->busySet) {
+        if (read(q->busy, &v, sizeof(v)) < 0 && errno != EAGAIN) perror("read eventfd");
+    }
+    q->busySet = busy;
+}
 
-    size_t contentLen = 0;
-    int ret = parse_request_header(headerCopy, headerLen, &contentLen);
-    if (ret != 0) {
-        send_400_response(connfd);
-        return;
+/* blocks while the queue is full */
+static void connq_push(struct conn_queue *q, int fd, int kept)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == CONNQ_SIZE)
+        pthread_cond_wait(&q->notFull, &q->lock);
+    unsigned k = (q->head + q->count) % CONNQ_SIZE;
+    q->fds[k]  = fd;
+    q->kept[k] = kept;
+    q->count++;
+    if (fd >= 0) connq_update(q);
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/* blocks while the queue is empty */
+static int connq_pop(struct conn_queue *q, int *kept)
+{
+    pthread_mutex_lock(&q->lock);
+    q->idle++;
+    connq_update(q);
+    while (q->count == 0)
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+    q->idle--;
+    int fd = q->fds[q->head];
+    *kept  = q->kept[q->head];
+    q->head = (q->head + 1) % CONNQ_SIZE;
+    q->count--;
+    connq_update(q);
+    pthread_cond_signal(&q->notFull);
+    pthread_mutex_unlock(&q->lock);
+    return fd;
+}
+
+/* hands an idle keep-alive connection to the acceptor to watch until
+ * until. it stays with the caller on -1, when nothing is waiting for the
+ * thread any more, and on 1, when there is no room or the worker is
+ * retiring */
+static int connq_park(struct conn_queue *q, int fd, long long until)
+{
+    int ret = -1;
+    pthread_mutex_lock(&q->lock);
+    if (q->count <= (unsigned)q->idle) {
+        ret = -1;
+    } else if (q->numParked == PARKED_SIZE || g_retire) {
+        ret = 1;
+    } else {
+        q->parked[q->numParked]      = fd;
+        q->parkedUntil[q->numParked] = until;
+        q->numParked++;
+        uint64_t v = 1;
+        if (write(q->parkWake, &v, sizeof(v)) < 0) perror("write eventfd");
+        ret = 0;
     }
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
 
-    if (contentLen > MAX_CONT) {
-        send_400_response(connfd);
-        return;
+/* frees the slots of exited workers. one the pool did not retire is
+ * refilled by the next maintain_pool() */
+static void reap_workers(void)
+{
+    int status = 0;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        int known = FALSE;
+        for (int k = 0; k < POOL_LIMIT; k++) {
+            struct worker *w = &g_workers[k];
+            if (w->pid != pid) continue;
+
+            w->pid = 0;
+            known = TRUE;
+
+            /* a worker that died mid-relay cannot give its window back.
+             * with -t the one worker owns the slots of all its threads */
+            int last = g_pool.threads ? g_pool.threads - 1 : k;
+            for (int t = k; t <= last; t++) {
+                if (g_scoreboard[t].held <= 0) continue;
+                __atomic_sub_fetch(&g_gov->inUse, g_scoreboard[t].held, __ATOMIC_RELAXED);
+                g_scoreboard[t].held = 0;
+            }
+            if (!w->retiring) {
+                if (WIFSIGNALED(status))
+                    fprintf(stderr, "worker %d (pid %d) killed by signal %d, respawning\n",
+                            k, (int)pid, WTERMSIG(status));
+                else
+                    fprintf(stderr, "worker %d (pid %d) exited with status %d, respawning\n",
+                            k, (int)pid, WEXITSTATUS(status));
+                w->respawn = TRUE;
+            }
+            break;
+        }
+
+        /* or one of the previous generation, done draining */
+        for (int k = 0; !known && k < g_numOld; k++) {
+            if (g_oldWorkers[k] != pid) continue;
+            g_oldWorkers[k] = g_oldWorkers[--g_numOld];
+            break;
+        }
     }
+}
 
-    unsigned char *bodyBuf = (unsigned char*)malloc(contentLen);
-    if (!bodyBuf) {
-        perror("malloc bodyBuf");
-        send_400_response(connfd);
-        return;
+/* once per MAINTAIN_MS: refill crashed slots, then, for the adaptive
+ * prefork pool, keep the idle workers between min and max spare. like
+ * Apache, spawning doubles each check while idle workers stay short and
+ * retiring goes one worker per check */
+static void maintain_pool(void)
+{
+    for (int k = 0; k < POOL_LIMIT; k++)
+        if (g_workers[k].respawn) spawn_worker(k);
+
+    if (!g_pool.adaptive) return;
+
+    int idle = 0, total = 0, lastIdle = -1;
+    for (int k = 0; k < POOL_LIMIT; k++) {
+        if (g_workers[k].pid == 0 || g_workers[k].retiring) continue;
+        total++;
+        if (g_scoreboard[k].state == SLOT_IDLE) {
+            idle++;
+            lastIdle = k;
+        }
     }
 
-    size_t received = 0;
-    size_t copyLen = (leftover <= contentLen) ? leftover : contentLen;
-    if (copyLen > 0) {
-        memcpy(bodyBuf, headerBuf + headerConsumed, copyLen);
-        received += copyLen;
+    if (idle > g_pool.maxSpare && lastIdle >= 0) {
+        g_workers[lastIdle].retiring = TRUE;
+        kill(g_workers[lastIdle].pid, SIGTERM);
+        g_spawnRate = 1;
+    }
+    else if (idle < g_pool.minSpare && total < g_pool.maxWorkers) {
+        int n = g_pool.minSpare - idle;
+        if (n > g_spawnRate) n = g_spawnRate;
+        if (n > g_pool.maxWorkers - total) n = g_pool.maxWorkers - total;
+        for (int k = 0; k < POOL_LIMIT && n > 0; k++) {
+            if (g_workers[k].pid != 0) continue;
+            spawn_worker(k);
+            n--;
+        }
+        if (g_spawnRate < MAX_SPAWN_RATE) g_spawnRate *= 2;
+    }
+    else {
+        g_spawnRate = 1;
     }
+}
 
-    
-    while (received < contentLen) {
-        ssize_t rn = read(connfd, bodyBuf + received, contentLen - received);
-        if (rn < 0) {
-            perror("read body");
-            free(bodyBuf);
-            send_400_response(connfd);
-            return;
+static void report_pool(void)
+{
+    unsigned long total = 0, busiest = 0;
+    unsigned long killed[NUM_PHASES] = { 0 };
+    int listed = 0, running = 0, idle = 0;
+
+    /* with -t the slots are the threads of worker 0 */
+    const char *unit = g_pool.threads ? "thread" : "worker";
+    for (int k = 0; k < POOL_LIMIT; k++) {
+        struct worker *w = &g_workers[g_pool.threads ? 0 : k];
+        unsigned long n = g_shm->w[k].accepted;
+        for (int ph = 0; ph < NUM_PHASES; ph++)
+            killed[ph] += g_scoreboard[k].killed[ph];
+        if (g_pool.threads && k >= g_pool.threads) continue;
+        if (w->pid == 0 && n == 0) continue;
+
+        const char *state = (w->pid == 0) ? "gone"
+                          : w->retiring ? "retiring"
+                          : (g_scoreboard[k].state == SLOT_IDLE) ? "idle" : "busy";
+        if (w->cpu >= 0)
+            fprintf(stderr, "%s %d (cpu %d) %s: %lu accepts\n", unit, k, w->cpu, state, n);
+        else
+            fprintf(stderr, "%s %d %s: %lu accepts\n", unit, k, state, n);
+
+        listed++;
+        total += n;
+        if (n > busiest) busiest = n;
+        if (w->pid != 0) {
+            running++;
+            if (!w->retiring && g_scoreboard[k].state == SLOT_IDLE) idle++;
         }
-        else if (rn == 0) {
-            
-            free(bodyBuf);
-            send_400_response(connfd);
-            return;
+    }
+    double mean = listed ? (double)total / listed : 0;
+    fprintf(stderr, "%d %ss (%d idle), total %lu accepts,"
+            " busiest %s %.0f%% above the mean\n",
+            running, unit, idle, total, unit, (mean > 0) ? (busiest / mean - 1) * 100 : 0.0);
+    if (!g_pool.epollMode && !g_pool.uringMode) {
+        fprintf(stderr, "connections killed past their deadline: %lu %s, %lu %s, %lu %s\n",
+                killed[PHASE_HEADER], g_phaseNames[PHASE_HEADER],
+                killed[PHASE_BODY], g_phaseNames[PHASE_BODY],
+                killed[PHASE_WRITE], g_phaseNames[PHASE_WRITE]);
+        if (g_gov->budget > 0) {
+            fprintf(stderr, "memory governor: %ld of %ld KB in use, %lu granted"
+                    " (%lu after waiting), %lu shrunk, %lu rejected\n",
+                    g_gov->inUse / 1024, g_gov->budget / 1024, g_gov->granted,
+                    g_gov->waited, g_gov->shrunk, g_gov->rejected);
         }
-        received += rn;
     }
 
-    
-    {
+    if (g_numOld > 0)
+        fprintf(stderr, "%d workers of the previous generation still draining\n", g_numOld);
+
+    static struct worker_metrics sum;
+    metrics_snapshot(g_shm, &sum);
+    metrics_print(stderr, &sum);
+}
+
+static void on_parent_signal(int sig)
+{
+    if (sig == SIGUSR1) g_reportRequested = 1;
+    else if (sig == SIGHUP) g_reloadRequested = 1;
+    else g_stopRequested = 1;
+}
+
+static void on_worker_term(int sig)
+{
+    g_retire = 1;
+}
+
+/* SIGTERM in every kind of worker: set g_retire and interrupt whatever
+ * blocking call it lands in (no SA_RESTART) */
+static void set_worker_term(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_worker_term;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+/* serves connfd until it closes. kept: it was parked between requests
+ * (-t). returns TRUE if it has been parked again, and must stay open */
+static int handle_connection(int connfd, int kept)
+{
+    struct conn c;
+    c.fd = connfd;
+    c.expired = -1;
+    c.reserved = 0;
+    c.crcCheck = FALSE;
+    c.zerocopy = 0;
+    c.zcNext   = c.zcDone = 0;
+    rbuf_init(&c.rb);
+    int served = kept ? 1 : 0;
+
+    int fl = fcntl(connfd, F_GETFL);
+    if (fl < 0 || fcntl(connfd, F_SETFL, fl | O_NONBLOCK) < 0) {
+        perror("fcntl O_NONBLOCK");
+        return FALSE;
+    }
+
+    /* one iteration per request; keep-alive requests loop back here and
+     * whatever the client pipelined behind the body is already in rb */
+    while (1) {
+        if (served > 0) {
+            int idle = conn_idle(&c, g_pool.threads > 0);
+            if (idle != 0) return idle > 0;
+        }
+
+        /* the header clock starts at accept or at the first byte of a
+         * keep-alive request, so a trickled header runs out of time */
+        conn_start_phase(&c, PHASE_HEADER);
+
+        char  *headerBuf = NULL;
+        size_t headerLen = 0;
+        int ret = conn_read(&c, rbuf_read_header, &headerBuf, &headerLen);
+        if (ret != RBUF_OK) {
+            if (c.expired >= 0) return FALSE;
+            /* a keep-alive client closing between requests is not an error */
+            if (ret == RBUF_EOF && served > 0 && rbuf_pending(&c.rb) == 0) return FALSE;
+            if (ret == RBUF_ERR) perror("read");
+            send_error_response(&c, 400);
+            return FALSE;
+        }
+
+        /* a SIMPLE/2.0 preface switches the connection over to frames */
+        if (served == 0 && strcmp(headerBuf, SIMPLE2_VERSION) == 0) {
+            struct iovec iov = { SIMPLE2_PREFACE, strlen(SIMPLE2_PREFACE) };
+            if (conn_send(&c, &iov, 1, 0) == 0) serve_frames(&c);
+            return FALSE;
+        }
+
+        /* parsed in place, straight out of the read buffer */
+        struct request_info req;
+        uint64_t t0 = metrics_now_ns();
+        ret = parse_request_header(headerBuf, headerLen, &req);
+        lhist_record(&g_metrics->parseNs, metrics_now_ns() - t0);
+        if (ret != 0) {
+            send_error_response(&c, 400);
+            return FALSE;
+        }
+
+        if (!req.chunked && req.contentLen > MAX_CONT) {
+            send_error_response(&c, 400);
+            return FALSE;
+        }
+
+        /* retiring: answered without keep-alive, so the client knows the
+         * connection ends here and sends nothing more on it */
+        if (g_retire) req.keepAlive = FALSE;
+
+        /* cut-through echo: Content-length is all the response header needs,
+         * so it goes out with the first body bytes and the rest of the body
+         * is relayed as it arrives. once the 200 is on the wire a short body
+         * can only end in a close. */
         char respHeader[256];
-        snprintf(respHeader, sizeof(respHeader),
-                 "SIMPLE/1.0 200 OK\r\n"
-                 "Content-length: %zu\r\n"
-                 "\r\n",
-                 contentLen);
-
-        
-        size_t hdrLen = strlen(respHeader);
-        size_t sent = 0;
-        while (sent < hdrLen) {
-            ssize_t wn = write(connfd, respHeader + sent, hdrLen - sent);
-            if (wn < 0) {
-                perror("write resp header");
-                free(bodyBuf);
-                return;
-            }
-            sent += wn;
+        int n;
+        if (req.chunked) {
+            n = snprintf(respHeader, sizeof(respHeader),
+                         "SIMPLE/1.0 200 OK\r\n"
+                         CHUNKED_HDR
+                         "%s"
+                         "\r\n",
+                         req.keepAlive ? KEEPALIVE_HDR : "");
+        } else {
+            n = snprintf(respHeader, sizeof(respHeader),
+                         "SIMPLE/1.0 200 OK\r\n"
+                         "Content-length: %zu\r\n"
+                         "%s"
+                         "\r\n",
+                         req.contentLen, req.keepAlive ? KEEPALIVE_HDR : "");
         }
 
-        
-        sent = 0;
-        while (sent < contentLen) {
-            ssize_t wn = write(connfd, bodyBuf + sent, contentLen - sent);
-            if (wn < 0) {
-                perror("write resp body");
-                free(bodyBuf);
-                return;
+        /* a body beyond what is buffered needs a relay window */
+        size_t want = RELAY_CHUNK;
+        if (!req.chunked) {
+            size_t buffered = rbuf_pending(&c.rb);
+            want = (req.contentLen > buffered) ? req.contentLen - buffered : 0;
+            if (want > RELAY_CHUNK) want = RELAY_CHUNK;
+        }
+        if (gov_reserve(&c, want) < 0) {
+            send_error_response(&c, 503);
+            return FALSE;
+        }
+
+        /* chunked bodies go through unchecked: the header has to come
+         * before the body, so only a Content-length body can carry one */
+        conn_start_phase(&c, PHASE_BODY);
+        c.bodyBytes = 0;
+        c.crcCheck  = req.hasCrc && !req.chunked;
+        c.crc       = 0;
+        c.crcWant   = req.crc;
+        ret = req.chunked ? relay_chunked(&c, respHeader, n)
+                          : relay_from(&c, req.contentLen, respHeader, n);
+        gov_release(&c);
+        if (ret < 0) {
+            if (c.expired < 0 && errno != EBADMSG) perror("relay body");
+            return FALSE;
+        }
+
+        uint64_t t1 = metrics_now_ns();
+        lhist_record(&g_metrics->bodyUs, (c.bodyDoneNs - t0) / 1000);
+        lhist_record(&g_metrics->echoUs, (t1 - t0) / 1000);
+        g_metrics->ok++;
+        g_metrics->bytesIn  += headerLen + 4 + c.bodyBytes;
+        g_metrics->bytesOut += n + c.bodyBytes;
+
+        served++;
+        if (!req.keepAlive) return FALSE;
+    }
+}
+
+/* SIMPLE/2.0: every frame is echoed as it arrives, its header unchanged
+ * in front of its payload. no state is kept per stream, so streams
+ * interleave in the echo exactly as the client interleaved them, and a
+ * large message never holds up the others. a malformed frame closes the
+ * connection */
+static void serve_frames(struct conn *c)
+{
+    while (1) {
+        if (conn_idle(c, FALSE) < 0) return;
+
+        conn_start_phase(c, PHASE_HEADER);
+        while (rbuf_pending(&c->rb) < FRAME_HDR_LEN) {
+            ssize_t rn = rbuf_fill(&c->rb, c->fd, RBUF_SIZE);
+            if (rn == 0) return;
+            if (rn < 0) {
+                if (errno == EINTR) continue;
+                if ((errno != EAGAIN && errno != EWOULDBLOCK) || conn_wait(c, POLLIN) < 0) {
+                    if (c->expired < 0) perror("read frame");
+                    return;
+                }
             }
-            sent += wn;
         }
+
+        unsigned char hdr[FRAME_HDR_LEN];
+        struct frame_header fh;
+        memcpy(hdr, c->rb.data + c->rb.start, FRAME_HDR_LEN);
+        if (frame_decode(hdr, &fh) < 0) return;
+        rbuf_consume(&c->rb, FRAME_HDR_LEN);
+
+        size_t buffered = rbuf_pending(&c->rb);
+        if (gov_reserve(c, (fh.len > buffered) ? fh.len - buffered : 0) < 0) return;
+
+        conn_start_phase(c, PHASE_BODY);
+        int ret = relay_from(c, fh.len, (const char *)hdr, FRAME_HDR_LEN);
+        gov_release(c);
+        if (ret < 0) {
+            if (c->expired < 0) perror("relay frame");
+            return;
+        }
+        g_metrics->frames++;
+        g_metrics->bytesIn  += fh.len;
+        g_metrics->bytesOut += fh.len;
     }
+}
 
-    free(bodyBuf);
+/* waits for the next request when nothing is buffered. an idle client
+ * must not hold this child forever: -1 after KEEPALIVE_TIMEOUT_MS. a
+ * retiring child waits as well, since the client may be sending on the
+ * connection right now; that request gets an answer without keep-alive.
+ * mayPark (-t): 1 once the connection is parked because others are
+ * waiting for a thread, so n threads are not held by n idle clients */
+static int conn_idle(struct conn *c, int mayPark)
+{
+    if (rbuf_pending(&c->rb) > 0) return 0;
+
+    struct pollfd pfd[2] = {
+        { .fd = c->fd, .events = POLLIN },
+        { .fd = g_connq.busy, .events = POLLIN }
+    };
+    int nfds = mayPark ? 2 : 1;
+    long long until = now_ms() + KEEPALIVE_TIMEOUT_MS;
+    while (1) {
+        long long left = until - now_ms();
+        int pn = poll(pfd, nfds, (left > 0) ? (int)left : 0);
+        if (pn < 0 && errno == EINTR) continue;
+        if (pn <= 0) return -1;
+        if (pfd[0].revents) return 0;
+        int ret = connq_park(&g_connq, c->fd, until);
+        if (ret == 0) return 1;
+        /* no room to park, or retiring: busy would stay readable */
+        if (ret > 0) nfds = 1;
+    }
 }
 
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-static int parse_request_header(char *headerBuf, size_t headerLen, size_t *contentLenOut)
+/* starts the clock of a phase; a limit of 0 means no deadline */
+static void conn_start_phase(struct conn *c, int phase)
 {
-    
-    headerBuf[headerLen] = '\0';
+    if (phase != PHASE_WRITE) c->readPhase = phase;
+    c->deadline[phase] = g_phaseMs[phase] ? now_ms() + g_phaseMs[phase] : 0;
+}
 
-    char *saveptr = NULL;
-    char *line = strtok_r(headerBuf, "\r\n", &saveptr);
+/* waits until the socket is ready for events: POLLOUT against the write
+ * deadline, POLLIN against that of the current read phase. no events at
+ * all waits for POLLERR, a zerocopy completion, against the write
+ * deadline. a missed deadline is counted on the scoreboard and fails
+ * with ETIMEDOUT */
+static int conn_wait(struct conn *c, short events)
+{
+    int phase = (events & POLLOUT) || events == 0 ? PHASE_WRITE : c->readPhase;
+    struct pollfd pfd = { .fd = c->fd, .events = events };
 
-    
-    if (!line) {
+    while (1) {
+        int timeout = -1;
+        if (c->deadline[phase] != 0) {
+            long long left = c->deadline[phase] - now_ms();
+            timeout = (left > 0) ? (int)left : 0;
+        }
+
+        int pn = poll(&pfd, 1, timeout);
+        if (pn > 0) return 0;
+        if (pn < 0 && errno == EINTR) continue;
+        if (pn < 0) return -1;
+
+        c->expired = phase;
+        g_slot->killed[phase]++;
+        errno = ETIMEDOUT;
         return -1;
     }
+}
 
-    {
-        
-        
-        char *saveptr2 = NULL;
-        char *token1 = strtok_r(line, " \t", &saveptr2);
-        char *token2 = strtok_r(NULL, " \t", &saveptr2);
-        char *token3 = strtok_r(NULL, " \t", &saveptr2);
-
-        if (!token1 || !token2 || !token3) {
+/* runs reader (rbuf_read_header or rbuf_read_line) to completion */
+static int conn_read(struct conn *c,
+                     int (*reader)(struct rbuf *, int, char **, size_t *),
+                     char **out, size_t *outLen)
+{
+    while (1) {
+        int ret = reader(&c->rb, c->fd, out, outLen);
+        if (ret != RBUF_AGAIN) return ret;
+        if (conn_wait(c, POLLIN) < 0) return RBUF_ERR;
+    }
+}
+
+/* sendv_full() with a fresh write deadline. iov keeps track of what is
+ * already out, so a send that would block picks up where it left off */
+static int conn_send(struct conn *c, struct iovec *iov, int cnt, int flags)
+{
+    conn_start_phase(c, PHASE_WRITE);
+    while (sendv_full(c->fd, iov, cnt, flags) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (conn_wait(c, POLLOUT) < 0) return -1;
+    }
+    return 0;
+}
+
+/* adds n bytes to the shared budget unless that would overrun it */
+static int gov_take(long n)
+{
+    long cur = __atomic_load_n(&g_gov->inUse, __ATOMIC_RELAXED);
+    do {
+        if (cur + n > g_gov->budget) return FALSE;
+    } while (!__atomic_compare_exchange_n(&g_gov->inUse, &cur, cur + n, TRUE,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    g_slot->held += n;
+    return TRUE;
+}
+
+/* sets the relay window of the next body, want bytes (rounded up to whole
+ * pages) if the budget has room. otherwise it waits up to GOV_WAIT_MS for
+ * room, then settles for GOV_SMALL_WINDOW. -1 when not even that fits */
+static int gov_reserve(struct conn *c, size_t want)
+{
+    c->window = RELAY_CHUNK;
+    if (g_gov->budget == 0 || want == 0) return 0;
+
+    want = (want + GOV_SMALL_WINDOW - 1) / GOV_SMALL_WINDOW * GOV_SMALL_WINDOW;
+    long long until = now_ms() + GOV_WAIT_MS;
+    int waited = FALSE;
+    while (!gov_take(want)) {
+        if (now_ms() >= until) {
+            if (want > GOV_SMALL_WINDOW && gov_take(GOV_SMALL_WINDOW)) {
+                __atomic_add_fetch(&g_gov->shrunk, 1, __ATOMIC_RELAXED);
+                c->window = c->reserved = GOV_SMALL_WINDOW;
+                return 0;
+            }
+            __atomic_add_fetch(&g_gov->rejected, 1, __ATOMIC_RELAXED);
             return -1;
         }
+        waited = TRUE;
+        poll(NULL, 0, 1);
+    }
 
-        if (strcmp(token1, "POST") != 0) {
+    __atomic_add_fetch(&g_gov->granted, 1, __ATOMIC_RELAXED);
+    if (waited) __atomic_add_fetch(&g_gov->waited, 1, __ATOMIC_RELAXED);
+    c->window = c->reserved = want;
+    return 0;
+}
+
+static void gov_release(struct conn *c)
+{
+    if (c->reserved == 0) return;
+    g_slot->held -= c->reserved;
+    __atomic_sub_fetch(&g_gov->inUse, (long)c->reserved, __ATOMIC_RELAXED);
+    c->reserved = 0;
+}
+
+/* echoes len body bytes behind the prefix (response header or chunk
+ * framing): the prefix and the body bytes already in rb leave in one
+ * sendmsg(), the rest comes straight from the socket. MSG_MORE holds that
+ * first segment open while more of the body is still to come */
+static int relay_from(struct conn *c, size_t len, const char *prefix, size_t prefixLen)
+{
+    struct rbuf *rb = &c->rb;
+    size_t buffered = rbuf_pending(rb);
+    if (buffered > len) buffered = len;
+    c->bodyBytes += len;
+    if (c->crcCheck) c->crc = crc32c_update(c->crc, rb->data + rb->start, buffered);
+    if (buffered == len) {
+        c->bodyDoneNs = metrics_now_ns();
+        if (conn_check_crc(c) < 0) {
+            /* nothing of the echo is out yet, so it can still be refused */
+            send_error_response(c, 400);
+            errno = EBADMSG;
             return -1;
         }
-        if (strcasecmp(token2, "message") != 0) {
+    }
+    if (send_prefixed(c, prefix, prefixLen, rb->data + rb->start, buffered,
+                      len > buffered) < 0) {
+        return -1;
+    }
+    rbuf_consume(rb, buffered);
+
+    return relay_body(c, len - buffered);
+}
+
+/* echoes a chunked body. the framing is parsed out of rb and re-emitted
+ * (without extensions or trailers), each frame riding along with the chunk
+ * data behind it; the response header goes with the first one */
+static int relay_chunked(struct conn *c, const char *head, size_t headLen)
+{
+    char   pend[320];
+    size_t pendLen = headLen;
+    int    first = TRUE;
+
+    memcpy(pend, head, headLen);
+    while (1) {
+        char  *line = NULL;
+        size_t lineLen = 0;
+        size_t size = 0;
+
+        int ret = conn_read(c, rbuf_read_line, &line, &lineLen);
+        if (ret != RBUF_OK) {
+            if (ret != RBUF_ERR) errno = EPROTO;
             return -1;
         }
-        if (strcasecmp(token3, "SIMPLE/1.0") != 0) {
+        if (parse_chunk_size(line, &size) < 0) {
+            errno = EPROTO;
+            return -1;
+        }
+
+        if (size == 0) {
+            /* trailer fields up to the empty line are dropped */
+            do {
+                ret = conn_read(c, rbuf_read_line, &line, &lineLen);
+                if (ret != RBUF_OK) {
+                    if (ret != RBUF_ERR) errno = EPROTO;
+                    return -1;
+                }
+            } while (lineLen > 0);
+            c->bodyDoneNs = metrics_now_ns();
+            pendLen += snprintf(pend + pendLen, sizeof(pend) - pendLen, "%s%s",
+                                first ? "" : "\r\n", CHUNK_END);
+            return send_prefixed(c, pend, pendLen, NULL, 0, FALSE);
+        }
+
+        /* the CRLF closing the previous chunk rides along with this frame */
+        pendLen += snprintf(pend + pendLen, sizeof(pend) - pendLen, "%s%zx\r\n",
+                            first ? "" : "\r\n", size);
+        first = FALSE;
+
+        if (relay_from(c, size, pend, pendLen) < 0) return -1;
+        pendLen = 0;
+
+        ret = conn_read(c, rbuf_read_line, &line, &lineLen);
+        if (ret != RBUF_OK || lineLen != 0) {
+            if (ret != RBUF_ERR) errno = EPROTO;
             return -1;
         }
     }
+}
 
-    
-    int foundHost = 0;
-    int foundCL   = 0;
-    *contentLenOut = 0;
-
-    while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
-
-        char *lower = strdup(line);
-        if (!lower) continue;
-        for (char *pp = lower; *pp; pp++)
-            *pp = tolower((unsigned char)*pp);
-
-        if (strstr(lower, "host:") == lower) {
-            foundHost = 1;
-        }
-        else if (strstr(lower, "content-length:") == lower) {
-            foundCL = 1;
-            
-            char *numPtr = strchr(line, ':');
-            if (numPtr) {
-                numPtr++; 
-                while (*numPtr && isspace((unsigned char)*numPtr)) numPtr++;
-                unsigned long long val = strtoull(numPtr, NULL, 10);
-                *contentLenOut = (size_t)val;
+/* prefix and data in one sendmsg(), with MSG_MORE when more follows.
+ * -L keeps the old two writes for comparison */
+static int send_prefixed(struct conn *c, const char *prefix, size_t prefixLen,
+                         const void *data, size_t len, int more)
+{
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)prefix;
+    iov[0].iov_len  = prefixLen;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len  = len;
+
+    if (!g_coalesce) {
+        if (conn_send(c, &iov[0], 1, 0) < 0) return -1;
+        return conn_send(c, &iov[1], 1, 0);
+    }
+    return conn_send(c, iov, 2, more ? MSG_MORE : 0);
+}
+
+/* TCP_NODELAY unless -N: responses are coalesced here, so Nagle can only
+ * hold back the last partial segment of each one */
+void apply_tcp_policy(int connfd)
+{
+    int on = 1;
+    if (g_nodelay && setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+        perror("setsockopt TCP_NODELAY");
+}
+
+/* echoes remain bytes from the socket back to it through a pipe with
+ * splice(), so the body never enters userspace. falls back to a bounded
+ * buffer when splice() is unavailable for this fd. */
+static int relay_body(struct conn *c, size_t remain)
+{
+    /* one pipe per process (per thread with -t), reused across connections */
+    static __thread int pipefd[2] = { -1, -1 };
+
+    if (remain == 0) return 0;
+
+    /* a checked body has to pass through userspace */
+    if (c->crcCheck) return relay_body_copy(c, remain);
+    if (g_zcThreshold > 0 && remain >= g_zcThreshold && c->zerocopy >= 0)
+        return relay_body_zc(c, remain);
+
+    if (pipefd[0] < 0 && pipe(pipefd) < 0) {
+        pipefd[0] = pipefd[1] = -1;
+        return relay_body_copy(c, remain);
+    }
+
+    while (remain > 0) {
+        size_t chunk = (remain < c->window) ? remain : c->window;
+        ssize_t in = splice(c->fd, NULL, pipefd[1], NULL, chunk,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (conn_wait(c, POLLIN) < 0) return -1;
+            continue;
+        }
+        if (in < 0 && errno == EINVAL) {
+            /* the pipe is still empty here, keep it for the next caller */
+            return relay_body_copy(c, remain);
+        }
+        if (in <= 0) {
+            if (in == 0) errno = ECONNRESET;
+            return -1;
+        }
+        remain -= in;
+        if (remain == 0) c->bodyDoneNs = metrics_now_ns();
+
+        /* each pipe load is one send as far as the write deadline goes */
+        conn_start_phase(c, PHASE_WRITE);
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, c->fd, NULL, in,
+                                 SPLICE_F_MOVE | (remain ? SPLICE_F_MORE : 0));
+            if (out < 0 && errno == EINTR) continue;
+            if (out < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+                && conn_wait(c, POLLOUT) == 0) {
+                continue;
             }
+            if (out <= 0) {
+                /* bytes are stranded in the pipe; start over with a fresh one */
+                int saved = errno;
+                close(pipefd[0]);
+                close(pipefd[1]);
+                pipefd[0] = pipefd[1] = -1;
+                errno = saved;
+                return -1;
+            }
+            in -= out;
         }
-        free(lower);
     }
+    return 0;
+}
 
-    if (!foundHost || !foundCL) {
-        return -1;
+static int relay_body_copy(struct conn *c, size_t remain)
+{
+    unsigned char buf[RELAY_CHUNK];
+
+    while (remain > 0) {
+        size_t chunk = (remain < c->window) ? remain : c->window;
+        ssize_t rn = read(c->fd, buf, chunk);
+        if (rn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (conn_wait(c, POLLIN) < 0) return -1;
+                continue;
+            }
+            return -1;
+        }
+        else if (rn == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        remain -= rn;
+        if (c->crcCheck) c->crc = crc32c_update(c->crc, buf, rn);
+        if (remain == 0) {
+            c->bodyDoneNs = metrics_now_ns();
+            if (conn_check_crc(c) < 0) return -1;
+        }
+
+        struct iovec iov = { buf, (size_t)rn };
+        if (conn_send(c, &iov, 1, 0) < 0) return -1;
     }
-    return 0; 
+    return 0;
 }
 
-static void send_400_response(int connfd)
+
+/* -Z: a large body is read into ZC_BUFS buffers in turn and each one is
+ * sent with MSG_ZEROCOPY, so the kernel transmits from the buffer instead
+ * of copying it. a buffer may only be refilled once the kernel reports
+ * its send complete on the error queue; the last reports are awaited
+ * before returning, since the buffers outlive the connection. together
+ * the buffers hold no more than the relay window. falls back to
+ * relay_body_copy() where the socket refuses SO_ZEROCOPY or the window is
+ * too small to split */
+static int relay_body_zc(struct conn *c, size_t remain)
 {
-    const char *resp = 
-        "SIMPLE/1.0 400 Bad Request\r\n"
-        "\r\n";
+    static __thread unsigned char *bufs;
+    uint32_t lastSeq[ZC_BUFS];         /* the last send out of each buffer */
+    int used[ZC_BUFS] = { FALSE };
 
+    size_t per = c->window / ZC_BUFS;
+    if (per < ZC_MIN_CHUNK) return relay_body_copy(c, remain);
+    if (per > RELAY_CHUNK) per = RELAY_CHUNK;
 
-    size_t len = strlen(resp);
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t wn = write(connfd, resp + sent, len - sent);
-        if (wn < 0) {
-            perror("write 400 response");
-            return;
+    if (c->zerocopy == 0) {
+        int on = 1;
+        c->zerocopy = (setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) ? 1 : -1;
+    }
+    if (!bufs) bufs = (unsigned char *)malloc((size_t)ZC_BUFS * RELAY_CHUNK);
+    if (c->zerocopy < 0 || !bufs) return relay_body_copy(c, remain);
+
+    for (int b = 0; remain > 0; b = (b + 1) % ZC_BUFS) {
+        unsigned char *buf = bufs + (size_t)b * RELAY_CHUNK;
+        if (used[b] && zc_reap(c, lastSeq[b] + 1) < 0) return -1;
+
+        size_t chunk = (remain < per) ? remain : per;
+        ssize_t rn;
+        while ((rn = read(c->fd, buf, chunk)) < 0) {
+            if (errno == EINTR) continue;
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || conn_wait(c, POLLIN) < 0)
+                return -1;
+        }
+        if (rn == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+        remain -= rn;
+        if (remain == 0) c->bodyDoneNs = metrics_now_ns();
+
+        /* every send call that takes bytes gets the next sequence number */
+        conn_start_phase(c, PHASE_WRITE);
+        size_t off = 0;
+        while (off < (size_t)rn) {
+            /* no MSG_MORE: a corked tail would hold back the very
+             * completion the next refill waits for */
+            ssize_t wn = send(c->fd, buf + off, rn - off, MSG_ZEROCOPY);
+            if (wn < 0) {
+                if (errno == EINTR) continue;
+                if ((errno == EAGAIN || errno == EWOULDBLOCK) && conn_wait(c, POLLOUT) == 0)
+                    continue;
+                if (errno != ENOBUFS) return -1;
+
+                /* over the socket's optmem limit: make room by reaping,
+                 * or copy this piece if nothing is outstanding */
+                if (c->zcDone != c->zcNext) {
+                    if (zc_reap(c, c->zcNext) < 0) return -1;
+                    continue;
+                }
+                struct iovec iov = { buf + off, rn - off };
+                if (conn_send(c, &iov, 1, 0) < 0) return -1;
+                break;
+            }
+            off += wn;
+            lastSeq[b] = c->zcNext++;
+            used[b] = TRUE;
+            g_metrics->zcSends++;
+        }
+    }
+    return zc_reap(c, c->zcNext);
+}
+
+/* reads zerocopy completions off the error queue until every send before
+ * sequence number until has completed. TCP completes them in order, so
+ * the highest one reported so far is all that is kept */
+static int zc_reap(struct conn *c, uint32_t until)
+{
+    while ((int32_t)(until - c->zcDone) > 0) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && conn_wait(c, 0) == 0)
+                continue;
+            return -1;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            /* ee_info..ee_data is the range of sends that completed */
+            if ((int32_t)(ee->ee_data + 1 - c->zcDone) > 0) c->zcDone = ee->ee_data + 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                g_metrics->zcCopied += ee->ee_data - ee->ee_info + 1;
         }
-        sent += wn;
     }
+    return 0;
+}
+
+/* a status line with no body (400 or 503); the connection is closed
+ * after it */
+static void send_error_response(struct conn *c, int code)
+{
+    char resp[64];
+    int n = snprintf(resp, sizeof(resp), "SIMPLE/1.0 %d %s\r\n\r\n", code,
+                     (code == 503) ? "Service Unavailable" : "Bad Request");
+
+    if (code == 503) g_metrics->unavailable++;
+    else g_metrics->bad++;
+
+    struct iovec iov = { resp, (size_t)n };
+    if (conn_send(c, &iov, 1, 0) < 0 && c->expired < 0)
+        perror("write error response");
+}
+
+/* checked once the last body byte is in, before the echo of that last
+ * read goes out: a body that fails is answered with a 400 if it was all
+ * buffered with its header, and otherwise cut short, so the client cannot
+ * mistake its echo for an intact one */
+static int conn_check_crc(struct conn *c)
+{
+    if (!c->crcCheck || c->crc == c->crcWant) return 0;
+
+    g_metrics->corrupt++;
+    fprintf(stderr, "body fails its Content-crc32c (%08x, header says %08x)\n",
+            c->crc, c->crcWant);
+    errno = EBADMSG;
+    return -1;
 }
@@ -0,0 +1,38 @@
+#ifndef SSERVER_H_
+#define SSERVER_H_
+
+#include <stddef.h>
+#include <signal.h>
+
+#include "simple_parse.h"
+#include "smetrics.h"
+
+/* the running worker's (or, with -t, thread's) block in the metrics
+ * segment (smetrics.h) */
+extern __thread struct worker_metrics *g_metrics;
+
+/* transmission policy. g_coalesce (cleared by -L) sends a response header
+ * together with the body bytes behind it; g_nodelay (cleared by -N) sets
+ * TCP_NODELAY on every connection through apply_tcp_policy() */
+extern int g_coalesce;
+extern int g_nodelay;
+void apply_tcp_policy(int connfd);
+
+/* set by SIGTERM in a worker, when the pool retires it or after a restart
+ * (SIGHUP on the parent): stop accepting, finish the requests in flight,
+ * close keep-alive connections once their current request is answered,
+ * then exit. the event loops keep SIGTERM blocked except while they wait,
+ * so it cannot slip in between their check and the wait */
+extern volatile sig_atomic_t g_retire;
+
+/* epoll worker: serves every connection accepted on listenfd from a single
+ * event loop with non-blocking sockets. never returns. */
+void run_epoll_worker(int listenfd);
+
+/* io_uring worker (sserver_uring.c): same protocol, driven by completions.
+ * uring_supported() tells whether this kernel can run it at all;
+ * run_uring_worker() never returns unless its ring cannot be set up */
+int  uring_supported(void);
+int  run_uring_worker(int listenfd);
+
+#endif
@@ -0,0 +1,530 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "macro.h"
+#include "sserver.h"
+#include "simple_io.h"
+
+#define MAX_EVENTS 256
+
+/* per-connection state machine:
+ * HEADER -> buffering until "\r\n\r\n" (at most MAX_HDR bytes)
+ * RELAY  -> the 200 header is queued first, then the body is echoed through
+ *           the rbuf one buffer at a time as it arrives; a keep-alive
+ *           request goes back to HEADER afterwards. a chunked body steps
+ *           through the chunk phases below, relaying one chunk at a time
+ * ERROR  -> writing the 400 response, then close
+ * FRAME  -> SIMPLE/2.0 after the preface: buffering a frame header, whose
+ *           payload is then relayed like a body with the unchanged frame
+ *           header in place of the status block */
+enum conn_state {
+    CONN_HEADER,
+    CONN_RELAY,
+    CONN_ERROR,
+    CONN_FRAME
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    uint32_t events;        /* current epoll interest */
+
+    /* holds the request header, then serves as the relay buffer */
+    struct rbuf rb;
+    size_t bodyLeft;        /* body (or chunk) bytes not echoed yet */
+    int    chunked;
+    enum chunk_phase chunkPhase;
+    int    keepAlive;
+    int    framed;          /* SIMPLE/2.0 */
+    int    served;          /* requests (or frames) completed on this connection */
+
+    /* metrics of the current request (or frame) */
+    uint64_t startNs;       /* header complete */
+    uint64_t bodyDoneNs;    /* last body byte read */
+    size_t   hdrBytes;      /* request header */
+    size_t   respBytes;     /* response header */
+    size_t   bodyBytes;     /* body echoed so far */
+
+    /* status/header block, sent before any relayed body byte */
+    const char *out;
+    size_t outLen;
+    size_t outSent;
+    char   respHeader[128];
+
+    struct conn *prev, *next;   /* g_conns */
+};
+
+/* handler results */
+#define CONN_WAIT 0         /* blocked, wait for the next epoll event */
+#define CONN_DONE 1         /* finished, close the connection */
+#define CONN_NEXT 2         /* state changed, run the next handler */
+
+static const char *resp400 =
+    "SIMPLE/1.0 400 Bad Request\r\n"
+    "\r\n";
+
+static int  set_nonblocking(int fd);
+static void accept_connections(int epfd, int listenfd);
+static void conn_close(struct conn *c);
+static int  conn_want(int epfd, struct conn *c, uint32_t events);
+static int  conn_run(int epfd, struct conn *c);
+static int  conn_on_header(int epfd, struct conn *c);
+static int  conn_on_frame(int epfd, struct conn *c);
+static int  conn_fail(struct conn *c);
+static int  conn_pump(int epfd, struct conn *c);
+static int  conn_on_chunk_line(int epfd, struct conn *c);
+static void conn_count(struct conn *c);
+static void close_idle(void);
+
+static int g_live;          /* open connections */
+static struct conn *g_conns;
+
+/*--------------------------------------------------------------------------------*/
+void run_epoll_worker(int listenfd)
+{
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(-1);
+    }
+
+    if (set_nonblocking(listenfd) < 0) {
+        perror("fcntl listen");
+        exit(-1);
+    }
+
+    /* workers sharing one listening socket are woken one at a time by
+     * EPOLLEXCLUSIVE; with -R the socket is this worker's alone anyway */
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        perror("epoll_ctl listen");
+        exit(-1);
+    }
+
+    sigset_t term, waitMask;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, &waitMask);
+    sigdelset(&waitMask, SIGTERM);
+    int accepting = TRUE;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        if (g_retire && accepting) {
+            /* the socket stays open in the other workers */
+            epoll_ctl(epfd, EPOLL_CTL_DEL, listenfd, NULL);
+            accepting = FALSE;
+            close_idle();
+        }
+        if (g_retire && g_live == 0) exit(0);
+
+        int n = epoll_pwait(epfd, events, MAX_EVENTS, -1, &waitMask);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(-1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = (struct conn *)events[i].data.ptr;
+            if (c == NULL) {
+                if (accepting) accept_connections(epfd, listenfd);
+                continue;
+            }
+
+            if (conn_run(epfd, c) == CONN_DONE) conn_close(c);
+        }
+    }
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void accept_connections(int epfd, int listenfd)
+{
+    while (1) {
+        int connfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            /* EMFILE and friends: leave the rest in the backlog */
+            perror("accept");
+            return;
+        }
+
+        g_metrics->accepted++;
+        g_live++;
+        apply_tcp_policy(connfd);
+
+        struct conn *c = (struct conn *)calloc(1, sizeof(*c));
+        if (!c) {
+            perror("calloc conn");
+            close(connfd);
+            continue;
+        }
+        c->fd     = connfd;
+        c->state  = CONN_HEADER;
+        c->events = EPOLLIN;
+        rbuf_init(&c->rb);
+        c->next   = g_conns;
+        if (g_conns) g_conns->prev = c;
+        g_conns   = c;
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events   = c->events;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            perror("epoll_ctl add");
+            conn_close(c);
+        }
+    }
+}
+
+static void conn_close(struct conn *c)
+{
+    if (c->prev) c->prev->next = c->next;
+    else g_conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+
+    /* close() drops the fd from the epoll set as well */
+    close(c->fd);
+    free(c);
+    g_live--;
+}
+
+static int conn_want(int epfd, struct conn *c, uint32_t events)
+{
+    if (c->events == events) return 0;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl mod");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+/* runs handlers until one has to wait or the connection is finished; a
+ * loop rather than recursion, since many pipelined requests can already be
+ * sitting in the buffer */
+static int conn_run(int epfd, struct conn *c)
+{
+    while (1) {
+        int ret;
+        if (c->state == CONN_HEADER)
+            ret = conn_on_header(epfd, c);
+        else if (c->state == CONN_FRAME)
+            ret = conn_on_frame(epfd, c);
+        else
+            ret = conn_pump(epfd, c);
+
+        if (ret != CONN_NEXT) return ret;
+    }
+}
+
+static int conn_on_header(int epfd, struct conn *c)
+{
+    char  *headerBuf = NULL;
+    size_t headerLen = 0;
+    int ret = rbuf_read_header(&c->rb, c->fd, &headerBuf, &headerLen);
+    if (ret == RBUF_AGAIN)
+        return (conn_want(epfd, c, EPOLLIN) < 0) ? CONN_DONE : CONN_WAIT;
+    if (ret != RBUF_OK) {
+        /* a keep-alive client closing between requests is not an error */
+        if (ret == RBUF_EOF && c->served > 0 && rbuf_pending(&c->rb) == 0)
+            return CONN_DONE;
+        if (ret == RBUF_ERR) perror("read");
+        return conn_fail(c);
+    }
+
+    if (c->served == 0 && strcmp(headerBuf, SIMPLE2_VERSION) == 0) {
+        c->out       = SIMPLE2_PREFACE;
+        c->outLen    = strlen(SIMPLE2_PREFACE);
+        c->outSent   = 0;
+        c->keepAlive = TRUE;
+        c->framed    = TRUE;
+        c->chunked   = FALSE;
+        c->bodyLeft  = 0;
+        c->state     = CONN_RELAY;
+        return CONN_NEXT;
+    }
+
+    struct request_info req;
+    c->startNs = metrics_now_ns();
+    ret = parse_request_header(headerBuf, headerLen, &req);
+    lhist_record(&g_metrics->parseNs, metrics_now_ns() - c->startNs);
+    if (ret != 0)
+        return conn_fail(c);
+    if (!req.chunked && req.contentLen > MAX_CONT)
+        return conn_fail(c);
+
+    /* retiring: the last response on this connection, and it says so */
+    if (g_retire) req.keepAlive = FALSE;
+
+    int n;
+    if (req.chunked) {
+        n = snprintf(c->respHeader, sizeof(c->respHeader),
+                     "SIMPLE/1.0 200 OK\r\n"
+                     CHUNKED_HDR
+                     "%s"
+                     "\r\n",
+                     req.keepAlive ? KEEPALIVE_HDR : "");
+    } else {
+        n = snprintf(c->respHeader, sizeof(c->respHeader),
+                     "SIMPLE/1.0 200 OK\r\n"
+                     "Content-length: %zu\r\n"
+                     "%s"
+                     "\r\n",
+                     req.contentLen, req.keepAlive ? KEEPALIVE_HDR : "");
+    }
+    c->out        = c->respHeader;
+    c->outLen     = (size_t)n;
+    c->outSent    = 0;
+    c->keepAlive  = req.keepAlive;
+    c->chunked    = req.chunked;
+    c->chunkPhase = CHUNK_SIZE;
+    c->bodyLeft   = req.chunked ? 0 : req.contentLen;
+    c->state      = CONN_RELAY;
+    c->hdrBytes   = headerLen + 4;
+    c->respBytes  = (size_t)n;
+    c->bodyBytes  = 0;
+    if (rbuf_pending(&c->rb) >= c->bodyLeft) c->bodyDoneNs = c->startNs;
+    return CONN_NEXT;
+}
+
+static int conn_fail(struct conn *c)
+{
+    g_metrics->bad++;
+    c->out     = resp400;
+    c->outLen  = strlen(resp400);
+    c->outSent = 0;
+    c->state   = CONN_ERROR;
+    return CONN_NEXT;
+}
+
+/* moves the connection as far as the socket allows without blocking:
+ * flush the status block together with the first body bytes, then
+ * alternate between writing out the buffered body bytes and reading the
+ * next buffer. the rbuf is only refilled once empty and never past the
+ * body, so bytes the client pipelined behind it stay buffered for the
+ * next request. */
+static int conn_pump(int epfd, struct conn *c)
+{
+    while (1) {
+        size_t pending = rbuf_pending(&c->rb);
+        if (pending > c->bodyLeft) pending = c->bodyLeft;
+
+        /* the status block waits for the first body bytes and leaves in the
+         * same writev(), unless there is no body to wait for (or -L) */
+        int holdOut = g_coalesce && c->state != CONN_ERROR
+                      && c->bodyLeft > 0 && pending == 0;
+        if (c->outSent < c->outLen && !holdOut) {
+            struct iovec iov[2];
+            iov[0].iov_base = (void *)(c->out + c->outSent);
+            iov[0].iov_len  = c->outLen - c->outSent;
+            iov[1].iov_base = c->rb.data + c->rb.start;
+            iov[1].iov_len  = g_coalesce ? pending : 0;
+            ssize_t wn = writev(c->fd, iov, 2);
+            if (wn < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return (conn_want(epfd, c, EPOLLOUT) < 0) ? CONN_DONE : CONN_WAIT;
+                perror("write response");
+                return CONN_DONE;
+            }
+            if ((size_t)wn <= iov[0].iov_len) {
+                c->outSent += wn;
+            } else {
+                c->outSent = c->outLen;
+                rbuf_consume(&c->rb, wn - iov[0].iov_len);
+                c->bodyLeft -= wn - iov[0].iov_len;
+                c->bodyBytes += wn - iov[0].iov_len;
+            }
+            continue;
+        }
+        if (c->state == CONN_ERROR) return CONN_DONE;
+
+        if (c->bodyLeft == 0 && c->chunked && c->chunkPhase != CHUNK_DONE) {
+            int ret = conn_on_chunk_line(epfd, c);
+            if (ret != CONN_NEXT) return ret;
+            continue;
+        }
+
+        if (c->bodyLeft == 0) {
+            conn_count(c);
+            c->served++;
+            /* retiring: no next request, whatever the last one asked for */
+            if (!c->keepAlive || g_retire) return CONN_DONE;
+            c->out    = NULL;
+            c->outLen = c->outSent = 0;
+            c->state  = c->framed ? CONN_FRAME : CONN_HEADER;
+            return CONN_NEXT;
+        }
+
+        if (pending > 0) {
+            ssize_t wn = write(c->fd, c->rb.data + c->rb.start, pending);
+            if (wn < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return (conn_want(epfd, c, EPOLLOUT) < 0) ? CONN_DONE : CONN_WAIT;
+                perror("write body");
+                return CONN_DONE;
+            }
+            rbuf_consume(&c->rb, wn);
+            c->bodyLeft -= wn;
+            c->bodyBytes += wn;
+            continue;
+        }
+
+        ssize_t rn = rbuf_fill(&c->rb, c->fd, c->bodyLeft);
+        if (rn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return (conn_want(epfd, c, EPOLLIN) < 0) ? CONN_DONE : CONN_WAIT;
+            perror("read body");
+            return CONN_DONE;
+        }
+        else if (rn == 0) {
+            /* the 200 may be out already, a short body can only end in close */
+            return CONN_DONE;
+        }
+        if (rbuf_pending(&c->rb) >= c->bodyLeft) c->bodyDoneNs = metrics_now_ns();
+    }
+}
+
+/* retiring: connections waiting for their next request (or frame) with
+ * nothing of it buffered are closed now rather than kept until the client
+ * sends one; the others close once their current response is out */
+static void close_idle(void)
+{
+    struct conn *c = g_conns;
+    while (c) {
+        struct conn *next = c->next;
+        if ((c->state == CONN_HEADER || c->state == CONN_FRAME)
+            && rbuf_pending(&c->rb) == 0 && c->outSent == c->outLen)
+            conn_close(c);
+        c = next;
+    }
+}
+
+/* a request (or frame) is out: into this worker's metrics block */
+static void conn_count(struct conn *c)
+{
+    if (c->framed) {
+        /* the preface is the first thing served, and not a frame */
+        if (c->served == 0) return;
+        g_metrics->frames++;
+        g_metrics->bytesIn  += c->bodyBytes;
+        g_metrics->bytesOut += c->bodyBytes;
+        return;
+    }
+
+    uint64_t now = metrics_now_ns();
+    g_metrics->ok++;
+    g_metrics->bytesIn  += c->hdrBytes + c->bodyBytes;
+    g_metrics->bytesOut += c->respBytes + c->bodyBytes;
+    lhist_record(&g_metrics->bodyUs, (c->bodyDoneNs - c->startNs) / 1000);
+    lhist_record(&g_metrics->echoUs, (now - c->startNs) / 1000);
+}
+
+/* takes the next SIMPLE/2.0 frame header off the buffer and queues its
+ * echo. end of stream and malformed frames close the connection */
+static int conn_on_frame(int epfd, struct conn *c)
+{
+    while (rbuf_pending(&c->rb) < FRAME_HDR_LEN) {
+        ssize_t rn = rbuf_fill(&c->rb, c->fd, RBUF_SIZE);
+        if (rn < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return (conn_want(epfd, c, EPOLLIN) < 0) ? CONN_DONE : CONN_WAIT;
+            perror("read frame");
+            return CONN_DONE;
+        }
+        else if (rn == 0) {
+            return CONN_DONE;
+        }
+    }
+
+    struct frame_header fh;
+    memcpy(c->respHeader, c->rb.data + c->rb.start, FRAME_HDR_LEN);
+    if (frame_decode((unsigned char *)c->respHeader, &fh) < 0) return CONN_DONE;
+    rbuf_consume(&c->rb, FRAME_HDR_LEN);
+
+    c->out       = c->respHeader;
+    c->outLen    = FRAME_HDR_LEN;
+    c->outSent   = 0;
+    c->bodyLeft  = fh.len;
+    c->bodyBytes = 0;
+    c->state    = CONN_RELAY;
+    return CONN_NEXT;
+}
+
+/* consumes one framing line of a chunked body and queues its echo.
+ * framing errors close the connection: the 200 is already out */
+static int conn_on_chunk_line(int epfd, struct conn *c)
+{
+    char  *line = NULL;
+    size_t lineLen = 0;
+    int ret = rbuf_read_line(&c->rb, c->fd, &line, &lineLen);
+    if (ret == RBUF_AGAIN)
+        return (conn_want(epfd, c, EPOLLIN) < 0) ? CONN_DONE : CONN_WAIT;
+    if (ret != RBUF_OK) {
+        if (ret == RBUF_ERR) perror("read chunk");
+        return CONN_DONE;
+    }
+
+    switch (c->chunkPhase) {
+    case CHUNK_SIZE: {
+        size_t size = 0;
+        if (parse_chunk_size(line, &size) < 0) return CONN_DONE;
+        if (size == 0) {
+            c->chunkPhase = CHUNK_TRAILER;
+            return CONN_NEXT;
+        }
+        int n = snprintf(c->respHeader, sizeof(c->respHeader), "%zx\r\n", size);
+        c->out        = c->respHeader;
+        c->outLen     = (size_t)n;
+        c->bodyLeft   = size;
+        c->chunkPhase = CHUNK_DATA_END;
+        break;
+    }
+    case CHUNK_DATA_END:
+        if (lineLen != 0) return CONN_DONE;
+        c->out        = "\r\n";
+        c->outLen     = 2;
+        c->chunkPhase = CHUNK_SIZE;
+        break;
+    case CHUNK_TRAILER:
+        /* trailer fields are dropped */
+        if (lineLen != 0) return CONN_NEXT;
+        c->bodyDoneNs = metrics_now_ns();
+        c->out        = CHUNK_END;
+        c->outLen     = strlen(CHUNK_END);
+        c->chunkPhase = CHUNK_DONE;
+        break;
+    case CHUNK_DONE:
+        break;
+    }
+    c->outSent = 0;
+    return CONN_NEXT;
+}
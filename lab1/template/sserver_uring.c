@@ -0,0 +1,829 @@
+#include <stdio.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/io_uring.h>
+
+#include "macro.h"
+#include "sserver.h"
+#include "simple_io.h"
+
+/* io_uring engine (-u), driven through the raw syscalls.
+ *
+ * every connection runs the same HEADER/RELAY/ERROR machine as the epoll
+ * worker, but instead of reading and writing when the socket is ready it
+ * queues one step at a time on the ring: a recv, or the sends that echo
+ * what the last recv brought. everything queued while handling a batch
+ * of completions goes to the kernel with the next io_uring_enter(),
+ * which also waits for the next completions.
+ *
+ * - accept: one multishot accept keeps posting new connections (single
+ *   shot re-armed per connection on kernels without it)
+ * - headers and chunk-size lines are received straight into the rbuf
+ * - body bytes are received into provided buffers the kernel picks from a
+ *   registered buffer ring and are sent back out of that buffer, so an
+ *   echoed body is never copied in userspace
+ * - the response header (or chunk framing) and the body bytes behind it
+ *   go out as two send SQEs linked with IOSQE_IO_LINK
+ * - after a SIMPLE/2.0 preface, each frame header is echoed as framing in
+ *   front of its payload, which is relayed like a body */
+
+#define UR_ENTRIES   256             /* submission queue size */
+#define UR_CQ_ENTRIES 4096
+#define UR_BUF_SIZE  (16*1024)       /* one provided buffer */
+#define UR_BUF_COUNT 256             /* power of two */
+#define UR_BGID      0               /* buffer group of the ring */
+#define UR_FRAMING   192             /* response header + chunk framing */
+
+/* what a completion belongs to, in the low bits of user_data */
+#define OP_ACCEPT 0
+#define OP_RECV   1
+#define OP_SEND0  2
+#define OP_SEND1  3
+#define OP_MASK   3ull
+
+enum uconn_state {
+    UC_HEADER,
+    UC_RELAY,
+    UC_ERROR
+};
+
+struct uconn {
+    int fd;
+    enum uconn_state state;
+
+    /* holds the request header and chunk-size lines */
+    struct rbuf rb;
+    size_t bodyLeft;        /* body (or chunk) bytes not received yet */
+    int    chunked;
+    enum chunk_phase chunkPhase;
+    int    keepAlive;
+    int    framed;          /* SIMPLE/2.0 */
+    int    served;
+
+    /* metrics of the current request (or frame) */
+    uint64_t startNs;       /* header complete */
+    uint64_t bodyDoneNs;    /* last body byte received */
+    size_t   hdrBytes;      /* request header */
+    size_t   respBytes;     /* response header */
+    size_t   bodyBytes;
+
+    /* response header or chunk framing waiting to go out ahead of the
+     * next body bytes */
+    char   framing[UR_FRAMING];
+    size_t framingLen;
+
+    /* the sends in flight: out[0] is the framing, out[1] body bytes from
+     * the rbuf (outRbuf) or from provided buffer outBid */
+    struct {
+        const char *p;
+        size_t len;
+    } out[2];
+    int    outPending;      /* send completions still to come */
+    int    outFailed;
+    size_t outRbuf;
+    int    outBid;
+
+    int    recvPbuf;        /* the recv in flight uses the buffer ring */
+    struct uconn *nextStarved;
+    struct uconn *prev, *next;  /* g_conns */
+};
+
+struct uring {
+    int fd;
+
+    unsigned  sqMask;
+    unsigned  sqEntries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned  sqTailLocal;
+    unsigned  toSubmit;
+    struct io_uring_sqe *sqes;
+
+    unsigned  cqMask;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *br;
+    uint16_t  brTail;
+    char     *bufBase;
+
+    /* what uring_setup() mapped, for uring_teardown() */
+    void     *ring;
+    size_t    ringLen;
+    size_t    sqesLen;
+
+    int listenfd;
+    int multishotAccept;
+    int accepting;          /* cleared once SIGTERM cancels the accept */
+    sigset_t waitMask;      /* the signal mask while waiting: SIGTERM open */
+    struct uconn *starved;  /* waiting for a provided buffer */
+};
+
+static int  uring_setup(struct uring *u);
+static void uring_teardown(struct uring *u);
+static void uring_make_room(struct uring *u, unsigned n);
+static struct io_uring_sqe *uring_sqe(struct uring *u);
+static int  uring_enter(struct uring *u, unsigned minComplete);
+static void uring_buf_recycle(struct uring *u, int bid);
+static void uring_arm_accept(struct uring *u);
+static void uring_cancel_accept(struct uring *u);
+static void on_accept(struct uring *u, int res, unsigned flags);
+static void on_recv(struct uring *u, struct uconn *c, int res, unsigned flags);
+static void on_send(struct uring *u, struct uconn *c, int piece, int res);
+static void uconn_advance(struct uring *u, struct uconn *c);
+static int  uconn_on_header(struct uconn *c);
+static int  uconn_on_frame(struct uconn *c);
+static int  uconn_on_chunk_line(struct uconn *c, const char *line, size_t lineLen);
+static void uconn_fail(struct uconn *c);
+static void uconn_count(struct uconn *c);
+static int  uconn_frame(struct uconn *c, const char *fmt, size_t arg);
+static void uconn_recv_rbuf(struct uring *u, struct uconn *c);
+static void uconn_recv_pbuf(struct uring *u, struct uconn *c);
+static void uconn_send(struct uring *u, struct uconn *c);
+static void uconn_submit(struct uring *u, struct uconn *c);
+static void uconn_close(struct uconn *c);
+static void uconn_close_idle(struct uring *u);
+
+static int g_live;          /* open connections */
+static struct uconn *g_conns;
+
+int uring_supported(void)
+{
+    struct uring u;
+    memset(&u, 0, sizeof(u));
+    if (uring_setup(&u) < 0) return FALSE;
+    uring_teardown(&u);
+    return TRUE;
+}
+
+int run_uring_worker(int listenfd)
+{
+    static struct uring u;
+    memset(&u, 0, sizeof(u));
+    if (uring_setup(&u) < 0) return -1;
+
+    u.listenfd        = listenfd;
+    u.multishotAccept = TRUE;
+    u.accepting       = TRUE;
+    uring_arm_accept(&u);
+
+    sigset_t term;
+    sigemptyset(&term);
+    sigaddset(&term, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term, &u.waitMask);
+    sigdelset(&u.waitMask, SIGTERM);
+
+    while (1) {
+        if (g_retire && u.accepting) {
+            uring_cancel_accept(&u);
+            u.accepting = FALSE;
+            uconn_close_idle(&u);
+        }
+        if (g_retire && g_live == 0) exit(0);
+
+        if (uring_enter(&u, 1) < 0) {
+            perror("io_uring_enter");
+            exit(-1);
+        }
+
+        unsigned head = *u.cqHead;
+        unsigned tail = __atomic_load_n(u.cqTail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &u.cqes[head & u.cqMask];
+            uint64_t data  = cqe->user_data;
+            int      res   = cqe->res;
+            unsigned flags = cqe->flags;
+            head++;
+            __atomic_store_n(u.cqHead, head, __ATOMIC_RELEASE);
+
+            struct uconn *c = (struct uconn *)(uintptr_t)(data & ~OP_MASK);
+            switch (data & OP_MASK) {
+            case OP_ACCEPT:
+                /* c is only set on the completions of cancels */
+                if (c == NULL) on_accept(&u, res, flags);
+                break;
+            case OP_RECV:   on_recv(&u, c, res, flags);    break;
+            case OP_SEND0:  on_send(&u, c, 0, res);        break;
+            case OP_SEND1:  on_send(&u, c, 1, res);        break;
+            }
+        }
+    }
+}
+
+/* creates the ring, maps it and registers the provided buffer ring.
+ * any failure means the kernel (or its seccomp policy) is not up to it */
+static int uring_setup(struct uring *u)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags      = IORING_SETUP_CQSIZE;
+    p.cq_entries = UR_CQ_ENTRIES;
+
+    u->ring    = MAP_FAILED;
+    u->sqes    = MAP_FAILED;
+    u->br      = MAP_FAILED;
+    u->bufBase = MAP_FAILED;
+    u->fd = syscall(__NR_io_uring_setup, UR_ENTRIES, &p);
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        uring_teardown(u);
+        return -1;
+    }
+
+    size_t sqLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cqLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringLen = (sqLen > cqLen) ? sqLen : cqLen;
+    u->ringLen = ringLen;
+    u->sqesLen = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->ring = mmap(NULL, ringLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, u->sqesLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        uring_teardown(u);
+        return -1;
+    }
+    char *ring = u->ring;
+
+    u->sqMask    = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sqEntries = p.sq_entries;
+    u->sqHead    = (unsigned *)(ring + p.sq_off.head);
+    u->sqTail    = (unsigned *)(ring + p.sq_off.tail);
+    u->sqTailLocal = *u->sqTail;
+    unsigned *sqArray = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned k = 0; k < p.sq_entries; k++)
+        sqArray[k] = k;
+
+    u->cqMask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqHead = (unsigned *)(ring + p.cq_off.head);
+    u->cqTail = (unsigned *)(ring + p.cq_off.tail);
+    u->cqes   = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    /* provided buffers: a ring of UR_BUF_COUNT descriptors shared with
+     * the kernel, all pointing into one block */
+    u->br = mmap(NULL, UR_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->bufBase = mmap(NULL, (size_t)UR_BUF_COUNT * UR_BUF_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED || u->bufBase == MAP_FAILED) {
+        uring_teardown(u);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = UR_BUF_COUNT;
+    reg.bgid         = UR_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_teardown(u);
+        return -1;
+    }
+    for (int bid = 0; bid < UR_BUF_COUNT; bid++)
+        uring_buf_recycle(u, bid);
+
+    return 0;
+}
+
+/* closes the ring, which drops the buffer ring registration, and unmaps
+ * whatever uring_setup() got to map */
+static void uring_teardown(struct uring *u)
+{
+    close(u->fd);
+    if (u->ring != MAP_FAILED) munmap(u->ring, u->ringLen);
+    if (u->sqes != MAP_FAILED) munmap(u->sqes, u->sqesLen);
+    if (u->br != MAP_FAILED) munmap(u->br, UR_BUF_COUNT * sizeof(struct io_uring_buf));
+    if (u->bufBase != MAP_FAILED) munmap(u->bufBase, (size_t)UR_BUF_COUNT * UR_BUF_SIZE);
+}
+
+/* submits what is queued until n SQEs are free */
+static void uring_make_room(struct uring *u, unsigned n)
+{
+    while (u->sqTailLocal - __atomic_load_n(u->sqHead, __ATOMIC_ACQUIRE) > u->sqEntries - n) {
+        if (uring_enter(u, 0) < 0) {
+            perror("io_uring_enter");
+            exit(-1);
+        }
+    }
+}
+
+/* a zeroed SQE at the tail of the submission queue */
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+    uring_make_room(u, 1);
+    struct io_uring_sqe *sqe = &u->sqes[u->sqTailLocal & u->sqMask];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sqTailLocal++;
+    u->toSubmit++;
+    return sqe;
+}
+
+/* submits everything queued and waits for minComplete completions.
+ * SIGTERM is let in only during the wait, which it cuts short */
+static int uring_enter(struct uring *u, unsigned minComplete)
+{
+    __atomic_store_n(u->sqTail, u->sqTailLocal, __ATOMIC_RELEASE);
+
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, u->fd, u->toSubmit, minComplete,
+                        minComplete ? IORING_ENTER_GETEVENTS : 0,
+                        minComplete ? &u->waitMask : NULL, _NSIG / 8);
+        if (n >= 0) {
+            u->toSubmit -= n;
+            return 0;
+        }
+        if (errno == EINTR && g_retire) return 0;
+        if (errno == EINTR) continue;
+        /* EBUSY/EAGAIN: completions must be reaped first, which the
+         * caller's loop does next */
+        if (errno == EBUSY || errno == EAGAIN) return 0;
+        return -1;
+    }
+}
+
+static void uring_buf_recycle(struct uring *u, int bid)
+{
+    struct io_uring_buf *b = &u->br->bufs[u->brTail & (UR_BUF_COUNT - 1)];
+    b->addr = (uint64_t)(uintptr_t)(u->bufBase + (size_t)bid * UR_BUF_SIZE);
+    b->len  = UR_BUF_SIZE;
+    b->bid  = bid;
+    u->brTail++;
+    __atomic_store_n(&u->br->tail, u->brTail, __ATOMIC_RELEASE);
+
+    /* a connection that found the ring empty gets this one */
+    if (u->starved) {
+        struct uconn *c = u->starved;
+        u->starved = c->nextStarved;
+        uconn_recv_pbuf(u, c);
+    }
+}
+
+static void uring_arm_accept(struct uring *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode    = IORING_OP_ACCEPT;
+    sqe->fd        = u->listenfd;
+    sqe->ioprio    = u->multishotAccept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data = OP_ACCEPT;
+}
+
+/* stops the accept, multishot or not; the listening socket stays open
+ * in the other workers */
+static void uring_cancel_accept(struct uring *u)
+{
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = OP_ACCEPT;
+    sqe->user_data = (uint64_t)(uintptr_t)u | OP_ACCEPT;
+}
+
+static void on_accept(struct uring *u, int res, unsigned flags)
+{
+    if (res >= 0) {
+        struct uconn *c = (struct uconn *)calloc(1, sizeof(*c));
+        if (!c) {
+            perror("calloc conn");
+            close(res);
+        } else {
+            g_metrics->accepted++;
+            g_live++;
+            apply_tcp_policy(res);
+            c->fd     = res;
+            c->state  = UC_HEADER;
+            c->outBid = -1;
+            rbuf_init(&c->rb);
+            c->next   = g_conns;
+            if (g_conns) g_conns->prev = c;
+            g_conns   = c;
+            uconn_advance(u, c);
+        }
+    }
+    else if (res == -EINVAL && u->multishotAccept) {
+        /* kernel without multishot accept: one SQE per connection */
+        u->multishotAccept = FALSE;
+    }
+    else if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+        errno = -res;
+        perror("accept");
+    }
+
+    if (!(flags & IORING_CQE_F_MORE) && u->accepting) uring_arm_accept(u);
+}
+
+static void on_recv(struct uring *u, struct uconn *c, int res, unsigned flags)
+{
+    if (res == -ENOBUFS) {
+        /* every provided buffer is out; retried on the next recycle */
+        c->nextStarved = u->starved;
+        u->starved = c;
+        return;
+    }
+    if (res < 0) {
+        /* -ECANCELED: retiring while the connection was idle */
+        if (res != -ECONNRESET && res != -ECANCELED) {
+            errno = -res;
+            perror("recv");
+        }
+        uconn_close(c);
+        return;
+    }
+    if (res == 0) {
+        /* a keep-alive client closing between requests is not an error;
+         * once the 200 is out a short body can only end in a close */
+        if (c->state == UC_HEADER && !c->framed
+            && !(c->served > 0 && rbuf_pending(&c->rb) == 0)) {
+            uconn_fail(c);
+            uconn_advance(u, c);
+            return;
+        }
+        uconn_close(c);
+        return;
+    }
+
+    if (!c->recvPbuf) {
+        rbuf_commit(&c->rb, res);
+        uconn_advance(u, c);
+        return;
+    }
+
+    /* body bytes in a provided buffer go straight back out, behind any
+     * framing still queued */
+    int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+    c->bodyLeft  -= res;
+    c->bodyBytes += res;
+    if (c->bodyLeft == 0) c->bodyDoneNs = metrics_now_ns();
+    c->outBid     = bid;
+    c->out[1].p   = u->bufBase + (size_t)bid * UR_BUF_SIZE;
+    c->out[1].len = res;
+    uconn_send(u, c);
+}
+
+static void on_send(struct uring *u, struct uconn *c, int piece, int res)
+{
+    c->outPending--;
+    if (res > 0) {
+        c->out[piece].p   += res;
+        c->out[piece].len -= res;
+    }
+    else if (res != -ECANCELED) {
+        /* a send that failed (or sent nothing) ends the connection; a
+         * cancelled one only lost its link to a short first send */
+        c->outFailed = TRUE;
+    }
+    if (c->outPending > 0) return;
+
+    if (c->outFailed) {
+        if (c->outBid >= 0) uring_buf_recycle(u, c->outBid);
+        uconn_close(c);
+        return;
+    }
+    if (c->out[0].len > 0 || c->out[1].len > 0) {
+        /* short send: the rest goes out in order */
+        uconn_submit(u, c);
+        return;
+    }
+
+    c->framingLen = 0;
+    if (c->outRbuf > 0) {
+        rbuf_consume(&c->rb, c->outRbuf);
+        c->outRbuf = 0;
+    }
+    if (c->outBid >= 0) {
+        int bid = c->outBid;
+        c->outBid = -1;
+        uring_buf_recycle(u, bid);
+    }
+    uconn_advance(u, c);
+}
+
+/* runs the state machine over what is buffered until it has queued one
+ * recv or one set of sends, or closed the connection */
+static void uconn_advance(struct uring *u, struct uconn *c)
+{
+    while (1) {
+        if (c->state == UC_HEADER) {
+            if ((c->framed ? uconn_on_frame(c) : uconn_on_header(c)) < 0) {
+                uconn_recv_rbuf(u, c);
+                return;
+            }
+            continue;
+        }
+
+        if (c->state == UC_ERROR) {
+            if (c->framingLen > 0) {
+                uconn_send(u, c);
+                return;
+            }
+            uconn_close(c);
+            return;
+        }
+
+        /* body bytes that came in with the header or a chunk line */
+        size_t pending = rbuf_pending(&c->rb);
+        if (c->bodyLeft > 0 && pending > 0) {
+            if (pending > c->bodyLeft) pending = c->bodyLeft;
+            c->bodyLeft  -= pending;
+            c->bodyBytes += pending;
+            if (c->bodyLeft == 0) c->bodyDoneNs = metrics_now_ns();
+            c->outRbuf    = pending;
+            c->out[1].p   = c->rb.data + c->rb.start;
+            c->out[1].len = pending;
+            uconn_send(u, c);
+            return;
+        }
+        if (c->bodyLeft > 0) {
+            uconn_recv_pbuf(u, c);
+            return;
+        }
+
+        if (c->chunked && c->chunkPhase != CHUNK_DONE) {
+            char  *line = NULL;
+            size_t lineLen = 0;
+            int ret = rbuf_find_line(&c->rb, &line, &lineLen);
+            if (ret == RBUF_AGAIN) {
+                uconn_recv_rbuf(u, c);
+                return;
+            }
+            /* framing errors close the connection: the 200 is already out */
+            if (ret != RBUF_OK || uconn_on_chunk_line(c, line, lineLen) < 0) {
+                uconn_close(c);
+                return;
+            }
+            continue;
+        }
+
+        if (c->framingLen > 0) {
+            uconn_send(u, c);
+            return;
+        }
+        uconn_count(c);
+        c->served++;
+        /* retiring: no next request, whatever the last one asked for */
+        if (!c->keepAlive || g_retire) {
+            uconn_close(c);
+            return;
+        }
+        c->state = UC_HEADER;
+    }
+}
+
+/* parses a buffered header and queues the 200 header as framing.
+ * returns -1 while the header is incomplete */
+static int uconn_on_header(struct uconn *c)
+{
+    char  *headerBuf = NULL;
+    size_t headerLen = 0;
+    int ret = rbuf_find_header(&c->rb, &headerBuf, &headerLen);
+    if (ret == RBUF_AGAIN) return -1;
+    if (ret != RBUF_OK) {
+        uconn_fail(c);
+        return 0;
+    }
+
+    if (c->served == 0 && strcmp(headerBuf, SIMPLE2_VERSION) == 0) {
+        c->framingLen = snprintf(c->framing, sizeof(c->framing), "%s", SIMPLE2_PREFACE);
+        c->keepAlive  = TRUE;
+        c->framed     = TRUE;
+        c->chunked    = FALSE;
+        c->bodyLeft   = 0;
+        c->state      = UC_RELAY;
+        return 0;
+    }
+
+    struct request_info req;
+    c->startNs = metrics_now_ns();
+    ret = parse_request_header(headerBuf, headerLen, &req);
+    lhist_record(&g_metrics->parseNs, metrics_now_ns() - c->startNs);
+    if (ret != 0 || (!req.chunked && req.contentLen > MAX_CONT)) {
+        uconn_fail(c);
+        return 0;
+    }
+
+    /* retiring: the last response on this connection, and it says so */
+    if (g_retire) req.keepAlive = FALSE;
+
+    if (req.chunked) {
+        c->framingLen = snprintf(c->framing, sizeof(c->framing),
+                                 "SIMPLE/1.0 200 OK\r\n"
+                                 CHUNKED_HDR
+                                 "%s"
+                                 "\r\n",
+                                 req.keepAlive ? KEEPALIVE_HDR : "");
+    } else {
+        c->framingLen = snprintf(c->framing, sizeof(c->framing),
+                                 "SIMPLE/1.0 200 OK\r\n"
+                                 "Content-length: %zu\r\n"
+                                 "%s"
+                                 "\r\n",
+                                 req.contentLen, req.keepAlive ? KEEPALIVE_HDR : "");
+    }
+    c->keepAlive  = req.keepAlive;
+    c->chunked    = req.chunked;
+    c->chunkPhase = CHUNK_SIZE;
+    c->bodyLeft   = req.chunked ? 0 : req.contentLen;
+    c->state      = UC_RELAY;
+    c->hdrBytes   = headerLen + 4;
+    c->respBytes  = c->framingLen;
+    c->bodyBytes  = 0;
+    c->bodyDoneNs = c->startNs;
+    return 0;
+}
+
+/* takes a buffered SIMPLE/2.0 frame header and queues it as the framing
+ * of its payload. returns -1 while fewer than FRAME_HDR_LEN bytes are in;
+ * a malformed frame closes the connection without a response */
+static int uconn_on_frame(struct uconn *c)
+{
+    if (rbuf_pending(&c->rb) < FRAME_HDR_LEN) return -1;
+
+    struct frame_header fh;
+    memcpy(c->framing, c->rb.data + c->rb.start, FRAME_HDR_LEN);
+    rbuf_consume(&c->rb, FRAME_HDR_LEN);
+    if (frame_decode((unsigned char *)c->framing, &fh) < 0) {
+        c->framingLen = 0;
+        c->state      = UC_ERROR;
+        return 0;
+    }
+    c->framingLen = FRAME_HDR_LEN;
+    c->bodyLeft   = fh.len;
+    c->bodyBytes  = 0;
+    c->state      = UC_RELAY;
+    return 0;
+}
+
+/* consumes one framing line of a chunked body and appends its echo to the
+ * framing. returns -1 on a framing error */
+static int uconn_on_chunk_line(struct uconn *c, const char *line, size_t lineLen)
+{
+    switch (c->chunkPhase) {
+    case CHUNK_SIZE: {
+        size_t size = 0;
+        if (parse_chunk_size(line, &size) < 0) return -1;
+        if (size == 0) {
+            c->chunkPhase = CHUNK_TRAILER;
+            return 0;
+        }
+        c->bodyLeft   = size;
+        c->chunkPhase = CHUNK_DATA_END;
+        return uconn_frame(c, "%zx\r\n", size);
+    }
+    case CHUNK_DATA_END:
+        if (lineLen != 0) return -1;
+        c->chunkPhase = CHUNK_SIZE;
+        return uconn_frame(c, "\r\n", 0);
+    case CHUNK_TRAILER:
+        /* trailer fields are dropped */
+        if (lineLen != 0) return 0;
+        c->bodyDoneNs = metrics_now_ns();
+        c->chunkPhase = CHUNK_DONE;
+        return uconn_frame(c, CHUNK_END, 0);
+    case CHUNK_DONE:
+        break;
+    }
+    return 0;
+}
+
+static void uconn_fail(struct uconn *c)
+{
+    static const char *resp400 =
+        "SIMPLE/1.0 400 Bad Request\r\n"
+        "\r\n";
+
+    c->framingLen = snprintf(c->framing, sizeof(c->framing), "%s", resp400);
+    c->state      = UC_ERROR;
+    g_metrics->bad++;
+}
+
+/* a request (or frame) is out: into this worker's metrics block */
+static void uconn_count(struct uconn *c)
+{
+    if (c->framed) {
+        /* the preface is the first thing served, and not a frame */
+        if (c->served == 0) return;
+        g_metrics->frames++;
+        g_metrics->bytesIn  += c->bodyBytes;
+        g_metrics->bytesOut += c->bodyBytes;
+        return;
+    }
+
+    uint64_t now = metrics_now_ns();
+    g_metrics->ok++;
+    g_metrics->bytesIn  += c->hdrBytes + c->bodyBytes;
+    g_metrics->bytesOut += c->respBytes + c->bodyBytes;
+    lhist_record(&g_metrics->bodyUs, (c->bodyDoneNs - c->startNs) / 1000);
+    lhist_record(&g_metrics->echoUs, (now - c->startNs) / 1000);
+}
+
+static int uconn_frame(struct uconn *c, const char *fmt, size_t arg)
+{
+    size_t room = sizeof(c->framing) - c->framingLen;
+    int n = snprintf(c->framing + c->framingLen, room, fmt, arg);
+    if (n < 0 || (size_t)n >= room) return -1;
+    c->framingLen += n;
+    return 0;
+}
+
+/* header and chunk-line bytes land in the rbuf, where they are parsed */
+static void uconn_recv_rbuf(struct uring *u, struct uconn *c)
+{
+    char *at;
+    size_t room = rbuf_room(&c->rb, &at);
+
+    c->recvPbuf = FALSE;
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = c->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)at;
+    sqe->len       = room;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_RECV;
+}
+
+/* body bytes go into a buffer the kernel takes from the ring. never more
+ * than the body, so a pipelined request behind it stays in the socket */
+static void uconn_recv_pbuf(struct uring *u, struct uconn *c)
+{
+    size_t want = (c->bodyLeft < UR_BUF_SIZE) ? c->bodyLeft : UR_BUF_SIZE;
+
+    c->recvPbuf = TRUE;
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = c->fd;
+    sqe->len       = want;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    sqe->user_data = (uint64_t)(uintptr_t)c | OP_RECV;
+}
+
+/* starts sending the framing followed by the body bytes in out[1] */
+static void uconn_send(struct uring *u, struct uconn *c)
+{
+    c->out[0].p   = c->framing;
+    c->out[0].len = c->framingLen;
+    c->outFailed  = FALSE;
+    uconn_submit(u, c);
+}
+
+/* queues what is left of out[] as sends linked with IOSQE_IO_LINK, so they
+ * reach the socket in order. a link cannot span two submissions, hence
+ * the room is made for both first */
+static void uconn_submit(struct uring *u, struct uconn *c)
+{
+    int last = (c->out[1].len > 0) ? 1 : 0;
+
+    uring_make_room(u, 2);
+    for (int k = 0; k <= last; k++) {
+        if (c->out[k].len == 0) continue;
+
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        sqe->opcode    = IORING_OP_SEND;
+        sqe->fd        = c->fd;
+        sqe->addr      = (uint64_t)(uintptr_t)c->out[k].p;
+        sqe->len       = c->out[k].len;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->flags     = 0;
+        if (k < last) {
+            /* MSG_MORE: the framing waits for the body instead of going
+             * out as a segment of its own */
+            sqe->msg_flags |= MSG_MORE;
+            sqe->flags     |= IOSQE_IO_LINK;
+        }
+        sqe->user_data = (uint64_t)(uintptr_t)c | (k ? OP_SEND1 : OP_SEND0);
+        c->outPending++;
+    }
+}
+
+/* retiring: the recv of each connection waiting for its next request (or
+ * frame) with nothing of it buffered is cancelled, and its completion
+ * closes the connection. one the cancel misses has received something,
+ * and closes once that is answered */
+static void uconn_close_idle(struct uring *u)
+{
+    for (struct uconn *c = g_conns; c; c = c->next) {
+        if (c->state != UC_HEADER || c->recvPbuf || rbuf_pending(&c->rb) > 0) continue;
+
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe->addr      = (uint64_t)(uintptr_t)c | OP_RECV;
+        sqe->user_data = (uint64_t)(uintptr_t)u | OP_ACCEPT;
+    }
+}
+
+static void uconn_close(struct uconn *c)
+{
+    if (c->prev) c->prev->next = c->next;
+    else g_conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+
+    close(c->fd);
+    free(c);
+    g_live--;
+}
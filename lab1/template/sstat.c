@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "macro.h"
+#include "smetrics.h"
+
+/* reads the metrics segment of a running sserver. only maps it read-only,
+ * so the workers never see it.
+ * usage: sstat -p port [-s] [-i seconds]
+ *
+ * -s prints the merged totals once; otherwise one line per interval
+ * (default 1 s) with rates and the echo latency of that interval */
+
+static const struct metrics *map_metrics(int port);
+static void hist_delta(struct lhist *out, const struct lhist *now, const struct lhist *prev);
+
+/*--------------------------------------------------------------------------------*/
+int
+main(const int argc, const char** argv)
+{
+    int port = -1;
+    int once = FALSE;
+    int interval = 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && (i+1) < argc) {
+            port = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            once = TRUE;
+        } else if (strcmp(argv[i], "-i") == 0 && (i+1) < argc) {
+            interval = atoi(argv[i+1]);
+            i++;
+        }
+    }
+    if (port <= 0 || port > 65535 || interval < 1) {
+        printf("usage: %s -p port [-s] [-i seconds]\n", argv[0]);
+        exit(-1);
+    }
+
+    const struct metrics *mt = map_metrics(port);
+    if (mt == NULL) exit(-1);
+
+    static struct worker_metrics prev, cur;
+    metrics_snapshot(mt, &cur);
+    if (once) {
+        metrics_print(stdout, &cur);
+        return 0;
+    }
+
+    printf("%8s %8s %8s %6s %6s %8s %9s %9s %8s %8s\n", "accept/s", "200/s", "frames/s",
+           "400/s", "503/s", "MB/s in", "MB/s out", "parse ns", "echo p50", "echo p99");
+    while (1) {
+        prev = cur;
+        sleep(interval);
+        if (kill(mt->pid, 0) < 0 && errno == ESRCH) {
+            fprintf(stderr, "sserver (pid %d) has stopped\n", (int)mt->pid);
+            return 0;
+        }
+        metrics_snapshot(mt, &cur);
+
+        struct lhist parse, echo;
+        hist_delta(&parse, &cur.parseNs, &prev.parseNs);
+        hist_delta(&echo, &cur.echoUs, &prev.echoUs);
+        double secs = interval;
+        printf("%8.0f %8.0f %8.0f %6.0f %6.0f %8.2f %9.2f %9.0f %8llu %8llu\n",
+               (cur.accepted - prev.accepted) / secs,
+               (cur.ok - prev.ok) / secs,
+               (cur.frames - prev.frames) / secs,
+               (cur.bad - prev.bad) / secs,
+               (cur.unavailable - prev.unavailable) / secs,
+               (cur.bytesIn - prev.bytesIn) / secs / (1024 * 1024),
+               (cur.bytesOut - prev.bytesOut) / secs / (1024 * 1024),
+               parse.count ? (double)parse.sum / parse.count : 0.0,
+               (unsigned long long)lhist_percentile(&echo, 50),
+               (unsigned long long)lhist_percentile(&echo, 99));
+        fflush(stdout);
+    }
+}
+
+static const struct metrics *map_metrics(int port)
+{
+    char name[32];
+    snprintf(name, sizeof(name), METRICS_NAME, port);
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "no sserver metrics for port %d (%s): %s\n", port, name, strerror(errno));
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct metrics)) {
+        fprintf(stderr, "%s is not a metrics segment\n", name);
+        close(fd);
+        return NULL;
+    }
+    const struct metrics *mt = (const struct metrics *)mmap(NULL, st.st_size, PROT_READ,
+                                                            MAP_SHARED, fd, 0);
+    close(fd);
+    if (mt == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    if (mt->magic != METRICS_MAGIC
+        || sizeof(struct metrics) + mt->slots * sizeof(struct worker_metrics) > (size_t)st.st_size) {
+        fprintf(stderr, "%s is not a metrics segment\n", name);
+        return NULL;
+    }
+    return mt;
+}
+
+/* what was recorded between two snapshots. min and max cannot be taken
+ * apart, so the later totals stand in for them */
+static void hist_delta(struct lhist *out, const struct lhist *now, const struct lhist *prev)
+{
+    for (unsigned i = 0; i < LHIST_BUCKETS; i++)
+        out->bucket[i] = now->bucket[i] - prev->bucket[i];
+    out->count = now->count - prev->count;
+    out->sum   = now->sum - prev->sum;
+    out->min   = now->min;
+    out->max   = now->max;
+}
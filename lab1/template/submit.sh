@@ -19,8 +19,8 @@ else
     echo "$FOLDER already exists!"
 fi
 
-SCLIENT="sclient.c"
-SSERVER="sserver.c"
+SCLIENT="sclient.c sclient.h sload.c lhist.c lhist.h"
+SSERVER="sserver.c sserver.h sserver_epoll.c sserver_uring.c simple_io.c simple_io.h simple_parse.c simple_parse.h smetrics.c smetrics.h sstat.c crc32c.c crc32c.h"
 MACRO="macro.h"
 README="readme.pdf"
 MAKEFILE="Makefile"
@@ -13,12 +13,33 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
 
 #include "macro.h"
 #define MAX_VAL  (MAX_HDR)
 #define MAX_URL 1024
+#define MAX_EVENTS 256   // epoll events per wakeup
+#define CACHE_FILES 512  // -c: open files the epoll mode keeps by default
+#define SMALL_FILE  (16*1024)   // -s: files up to this size are kept in memory
+#define CACHE_MEM   (16*1024)   // -m: KB of small files kept in memory by default
+#define PIPELINE 16      // pipelined replies the epoll mode sends in one writev()
+#define MAX_RANGES 8     // a Range header asking for more is ignored
 
 static const char* g_rootDir = "./";
+static int g_epoll = FALSE;   // -e: one epoll loop instead of fork per connection
+static int g_cacheFiles = CACHE_FILES;
+static long g_smallFile = SMALL_FILE;
+static long g_cacheMem = CACHE_MEM;
+static volatile sig_atomic_t g_report;   // SIGUSR1: print the cache counters
+static int g_epfd = -1;        // the epoll mode's loop and listening socket
+static int g_listenFd = -1;
+static int g_acceptPaused;     // out of descriptors: listener disarmed until a close
 const char *errMessage400 = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
 const char *errMessage404 = "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
 const char *errMessage500 = "HTTP/1.0 500 Internal Server Error\r\nConnection: close\r\n\r\n";
@@ -43,16 +64,539 @@ int is_connection_keep_alive(const char *buf) {
     return 0;
 }
 
+// an open file kept for its URL, with the 200 header prebuilt
+struct fentry {
+    char *url;                   // key, without the query string
+    char *path;
+    const char *name;            // last component of path
+    int wd;                      // inotify watch on its directory
+    int fd;                      // -1 once the file is in data
+    char *data;                  // the whole file, for small files
+    off_t size;
+    time_t mtime;
+    char hdr[2][160];            // [keep_alive]
+    int hdrLen[2];
+    int refs;                    // replies still sending from fd
+    int cached;                  // still findable by url
+    struct fentry *hnext;        // hash chain
+    struct fentry *prev, *next;  // LRU list, most recent first
+};
+
+// the -e mode's URL -> open file cache. the inotify fd watches the
+// directory of every cached file and drops entries whose file changes.
+struct fcache {
+    int capacity;                // 0: off
+    int count;
+    unsigned mask;               // buckets - 1
+    struct fentry **buckets;
+    struct fentry *head, *tail;
+    int ifd;
+    long memBytes;               // file bytes held in data of cached entries
+    long memBudget;
+    long hits, memHits, misses, evictions, invalidations;
+};
+
+static struct fcache g_cache;
+
+// what to send for one request header
+struct reply {
+    int status;        // 200, 206, 400, 404, 416 or 500
+    int keep_alive;
+    int file_fd;       // the open file for 200/206/416, -1 otherwise
+    off_t size;
+    time_t mtime;
+    struct fentry *fe; // the cache entry file_fd belongs to, if any
+    int nranges;       // 206: ranges to send, as multipart if more than one
+    off_t from[MAX_RANGES];
+    off_t to[MAX_RANGES];   // inclusive
+};
+
+// a reply prepared in a batch but not yet started
+struct pending {
+    struct reply r;
+    char hdr[256];
+    int hdrLen;
+};
+
+// one client of the epoll loop
+struct conn {
+    int fd;
+    int writing;               // a reply is being sent
+    int peerClosed;            // read() saw EOF: answer what is buffered, then close
+    uint32_t events;           // what epoll waits for
+    char buffer[MAX_HDR + 1];  // request header, NUL-terminated
+    int len;
+    struct reply r;
+    char hdr[256];             // reply header
+    int hdrLen;
+    int hdrSent;
+    off_t offset;              // sendfile() progress
+    int part;                  // 206: the range being sent
+    char partHdr[128];         // its multipart header
+    int partLen;
+    int partSent;
+    struct pending *queue;     // replies behind r, PIPELINE of them once allocated
+    int queued;
+};
+
+static void http_date(time_t t, char *out, size_t size) {
+    strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&t));
+}
+
+// whether file bytes follow the header
+static int reply_has_body(const struct reply *r) {
+    return r->status == 206 || (r->status == 200 && r->size > 0);
+}
+
+// the multipart header in front of range k of a 206, or the closing
+// boundary for k == nranges. empty for a single range
+static int part_header(const struct reply *r, int k, char *out, size_t size) {
+    if (r->nranges <= 1) {
+        out[0] = '\0';
+        return 0;
+    }
+    if (k == r->nranges)
+        return snprintf(out, size, "\r\n--%08lx%08lx--\r\n", (long)r->mtime, (long)r->size);
+    return snprintf(out, size, "%s--%08lx%08lx\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                    k > 0 ? "\r\n" : "", (long)r->mtime, (long)r->size,
+                    r->from[k], r->to[k], r->size);
+}
+
+// the reply header into out, returns its length
+static int reply_header(const struct reply *r, char *out, size_t size) {
+    const char *conn = r->keep_alive ? "Keep-Alive" : "close";
+    char date[64];   // only 200 and 206 replies have a file, and so an mtime
+
+    switch (r->status) {
+    case 200:
+        http_date(r->mtime, date, sizeof(date));
+        return snprintf(out, size, "HTTP/1.0 200 OK\r\nContent-length: %ld\r\nLast-Modified: %s\r\n"
+                        "Connection: %s\r\n\r\n",
+                        r->size, date, conn);
+    case 206: {
+        http_date(r->mtime, date, sizeof(date));
+        if (r->nranges == 1)
+            return snprintf(out, size, "HTTP/1.0 206 Partial Content\r\nContent-length: %ld\r\n"
+                            "Content-Range: bytes %ld-%ld/%ld\r\nLast-Modified: %s\r\nConnection: %s\r\n\r\n",
+                            r->to[0] - r->from[0] + 1, r->from[0], r->to[0], r->size, date, conn);
+        char part[128];
+        off_t length = 0;
+        for (int k = 0; k <= r->nranges; k++) {
+            length += part_header(r, k, part, sizeof(part));
+            if (k < r->nranges) length += r->to[k] - r->from[k] + 1;
+        }
+        return snprintf(out, size, "HTTP/1.0 206 Partial Content\r\nContent-length: %ld\r\n"
+                        "Content-Type: multipart/byteranges; boundary=%08lx%08lx\r\n"
+                        "Last-Modified: %s\r\nConnection: %s\r\n\r\n",
+                        length, (long)r->mtime, (long)r->size, date, conn);
+    }
+    case 416:
+        return snprintf(out, size, "HTTP/1.0 416 Range Not Satisfiable\r\nContent-length: 0\r\n"
+                        "Content-Range: bytes */%ld\r\nConnection: %s\r\n\r\n", r->size, conn);
+    case 404:
+    case 500:
+        // on a kept connection the body must be framed, or the next reply
+        // would be taken for it
+        if (r->keep_alive)
+            return snprintf(out, size, "HTTP/1.0 %s\r\nContent-length: 0\r\nConnection: Keep-Alive\r\n\r\n",
+                            r->status == 404 ? "404 Not Found" : "500 Internal Server Error");
+        return snprintf(out, size, "%s", r->status == 404 ? errMessage404 : errMessage500);
+    default:
+        return snprintf(out, size, "%s", errMessage400);
+    }
+}
+
+static unsigned url_hash(const char *url) {
+    unsigned h = 2166136261u;   // FNV-1a
+    while (*url) h = (h ^ (unsigned char)*url++) * 16777619u;
+    return h;
+}
+
+static void cache_unlink(struct fentry *fe) {
+    struct fentry **pp = &g_cache.buckets[url_hash(fe->url) & g_cache.mask];
+    while (*pp != fe) pp = &(*pp)->hnext;
+    *pp = fe->hnext;
+
+    if (fe->prev) fe->prev->next = fe->next;
+    else g_cache.head = fe->next;
+    if (fe->next) fe->next->prev = fe->prev;
+    else g_cache.tail = fe->prev;
+    fe->cached = FALSE;
+    g_cache.count--;
+    // a reply may still send from data, but the budget is for cached bytes
+    if (fe->data) g_cache.memBytes -= fe->size;
+}
+
+static void cache_free(struct fentry *fe) {
+    if (fe->fd >= 0) close(fe->fd);
+    free(fe->data);
+    free(fe->url);
+    free(fe->path);
+    free(fe);
+}
+
+// forgets fe; its fd closes once the last reply using it is done
+static void cache_drop(struct fentry *fe) {
+    cache_unlink(fe);
+    if (fe->refs == 0) cache_free(fe);
+}
+
+static void cache_release(struct fentry *fe) {
+    if (--fe->refs == 0 && !fe->cached) cache_free(fe);
+}
+
+static void cache_front(struct fentry *fe) {
+    if (g_cache.head == fe) return;
+    fe->prev->next = fe->next;
+    if (fe->next) fe->next->prev = fe->prev;
+    else g_cache.tail = fe->prev;
+    fe->prev = NULL;
+    fe->next = g_cache.head;
+    g_cache.head->prev = fe;
+    g_cache.head = fe;
+}
+
+// the entry for url with a reference taken, or NULL
+static struct fentry *cache_get(const char *url) {
+    if (g_cache.capacity == 0) return NULL;
+    struct fentry *fe = g_cache.buckets[url_hash(url) & g_cache.mask];
+    while (fe && strcmp(fe->url, url) != 0) fe = fe->hnext;
+    if (fe) {
+        cache_front(fe);
+        fe->refs++;
+        g_cache.hits++;
+        if (fe->data) g_cache.memHits++;
+    } else {
+        g_cache.misses++;
+    }
+    return fe;
+}
+
+// reads a small file into fe->data and closes its fd, evicting the least
+// recently used files in memory until it fits the budget
+static void cache_load(struct fentry *fe) {
+    if (fe->size > g_smallFile || fe->size > g_cache.memBudget) return;
+    char *data = (char *)malloc(fe->size ? fe->size : 1);
+    if (data == NULL) return;
+    off_t got = 0;
+    while (got < fe->size) {
+        ssize_t n = pread(fe->fd, data + got, fe->size - got, got);
+        if (n <= 0) {
+            free(data);
+            return;
+        }
+        got += n;
+    }
+
+    struct fentry *old = g_cache.tail;
+    while (old && g_cache.memBytes + fe->size > g_cache.memBudget) {
+        struct fentry *prev = old->prev;
+        if (old->data) {
+            cache_drop(old);
+            g_cache.evictions++;
+        }
+        old = prev;
+    }
+    if (g_cache.memBytes + fe->size > g_cache.memBudget) {
+        // nothing left to evict makes room: keep serving from the fd
+        free(data);
+        return;
+    }
+    close(fe->fd);
+    fe->fd = -1;
+    fe->data = data;
+    g_cache.memBytes += fe->size;
+}
+
+// caches fd for url, evicting the least recently used entry when full.
+// returns the new entry with a reference taken, or NULL if it cannot be
+// watched (fd then stays the caller's). a small file is read into memory
+// and fd closed; the reply then sends from fe->data
+static struct fentry *cache_put(const char *url, const char *path, int fd, const struct stat *st) {
+    if (g_cache.capacity == 0) return NULL;
+
+    const char *slash = strrchr(path, '/');
+    char dir[2048];
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + 1 : 0, path);
+    if (dir[0] == '\0') strcpy(dir, ".");
+    int wd = inotify_add_watch(g_cache.ifd, dir, IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE |
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) return NULL;
+
+    struct fentry *fe = (struct fentry *)calloc(1, sizeof(*fe));
+    if (fe == NULL) return NULL;
+    fe->url = strdup(url);
+    fe->path = strdup(path);
+    if (fe->url == NULL || fe->path == NULL) {
+        free(fe->url);
+        free(fe->path);
+        free(fe);
+        return NULL;
+    }
+    if (g_cache.count == g_cache.capacity) {
+        cache_drop(g_cache.tail);
+        g_cache.evictions++;
+    }
+
+    fe->name = fe->path + (slash ? slash - path + 1 : 0);
+    fe->wd = wd;
+    fe->fd = fd;
+    fe->size = st->st_size;
+    fe->mtime = st->st_mtime;
+    for (int k = 0; k < 2; k++) {
+        struct reply r = { .status = 200, .keep_alive = k, .size = fe->size, .mtime = fe->mtime };
+        fe->hdrLen[k] = reply_header(&r, fe->hdr[k], sizeof(fe->hdr[k]));
+    }
+    fe->refs = 1;
+    fe->cached = TRUE;
+    cache_load(fe);
+
+    struct fentry **bucket = &g_cache.buckets[url_hash(url) & g_cache.mask];
+    fe->hnext = *bucket;
+    *bucket = fe;
+    fe->next = g_cache.head;
+    if (g_cache.head) g_cache.head->prev = fe;
+    g_cache.head = fe;
+    if (g_cache.tail == NULL) g_cache.tail = fe;
+    g_cache.count++;
+    return fe;
+}
+
+// drops the entries an inotify event is about: the named file in a
+// watched directory, or everything in it when the directory itself goes
+static void cache_invalidate(const struct inotify_event *ev) {
+    struct fentry *fe = g_cache.head;
+    while (fe) {
+        struct fentry *next = fe->next;
+        if ((ev->mask & IN_Q_OVERFLOW) ||
+            (fe->wd == ev->wd && (ev->len == 0 || strcmp(fe->name, ev->name) == 0))) {
+            cache_drop(fe);
+            g_cache.invalidations++;
+        }
+        fe = next;
+    }
+}
+
+static void cache_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(g_cache.ifd, buf, sizeof(buf));
+        if (n <= 0) return;
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            cache_invalidate(ev);
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+}
+
+// closes the least recently used cached fd no reply is using, so a new
+// connection can have the descriptor. FALSE if there is none
+static int cache_shed(void) {
+    for (struct fentry *fe = g_cache.tail; fe; fe = fe->prev) {
+        if (fe->fd >= 0 && fe->refs == 0) {
+            cache_drop(fe);
+            g_cache.evictions++;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void cache_report(void) {
+    fprintf(stderr, "cache: %d files, %ld of %ld bytes in memory; hits %ld (%ld from memory), "
+            "misses %ld, evictions %ld, invalidations %ld\n",
+            g_cache.count, g_cache.memBytes, g_cache.memBudget, g_cache.hits, g_cache.memHits,
+            g_cache.misses, g_cache.evictions, g_cache.invalidations);
+}
+
+static void on_usr1(int sig) {
+    g_report = TRUE;
+}
+
+static void cache_init(int epfd, int capacity) {
+    unsigned buckets = 1;
+    while (buckets < 2u * capacity) buckets <<= 1;
+    g_cache.buckets = (struct fentry **)calloc(buckets, sizeof(struct fentry *));
+    g_cache.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_cache.buckets == NULL || g_cache.ifd < 0) {
+        perror("file cache");
+        return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &g_cache };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, g_cache.ifd, &ev) < 0) {
+        perror("epoll_ctl");
+        return;
+    }
+    g_cache.mask = buckets - 1;
+    g_cache.capacity = capacity;
+    g_cache.memBudget = g_cacheMem * 1024;
+    signal(SIGUSR1, on_usr1);
+}
+
+// gives back the file of a finished reply
+static void reply_done(struct reply *r) {
+    if (r->fe) cache_release(r->fe);
+    else if (r->file_fd >= 0) close(r->file_fd);
+    r->fe = NULL;
+    r->file_fd = -1;
+}
+
+static const char *skip_spaces(const char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+// Range: bytes=a-b, a- and -n (the last n bytes), comma-separated. turns a
+// 200 into a 206 for the satisfiable ranges, or a 416 if there are none.
+// a header that does not parse, asks for more than MAX_RANGES ranges, or
+// comes with an If-Range that is not our Last-Modified is ignored
+static void parse_range(const char *buffer, struct reply *r) {
+    const char *p = strcasestr(buffer, "\r\nRange:");
+    if (p == NULL) return;
+
+    const char *ifRange = strcasestr(buffer, "\r\nIf-Range:");
+    if (ifRange) {
+        char date[64];
+        http_date(r->mtime, date, sizeof(date));
+        ifRange = skip_spaces(ifRange + 11);
+        if (strncmp(ifRange, date, strlen(date)) != 0) return;
+    }
+
+    p = skip_spaces(p + 8);
+    if (strncasecmp(p, "bytes=", 6) != 0) return;
+    p += 6;
+
+    int n = 0;
+    while (1) {
+        char *endp;
+        long long from, to;
+        p = skip_spaces(p);
+        if (*p == '-') {
+            long long last = strtoll(p + 1, &endp, 10);
+            if (endp == p + 1 || last < 0) return;
+            from = (last < r->size) ? r->size - last : 0;
+            to = (last > 0) ? r->size - 1 : -1;   // -0 matches nothing
+        } else if (isdigit((unsigned char)*p)) {
+            from = strtoll(p, &endp, 10);
+            if (*endp != '-') return;
+            p = endp + 1;
+            if (isdigit((unsigned char)*p)) {
+                to = strtoll(p, &endp, 10);
+                if (to < from) return;
+            } else {
+                to = r->size - 1;
+                endp = (char *)p;
+            }
+        } else {
+            return;
+        }
+        if (from < r->size && from <= to) {
+            if (n == MAX_RANGES) return;
+            r->from[n] = from;
+            r->to[n] = (to < r->size) ? to : r->size - 1;
+            n++;
+        }
+        p = skip_spaces(endp);
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p == '\r' || *p == '\n' || *p == '\0') break;
+        return;
+    }
+
+    r->nranges = n;
+    r->status = (n > 0) ? 206 : 416;
+}
+
+// parses the header in buffer and opens the file it asks for,
+// or takes it from the cache
+static void prepare_reply(const char *buffer, struct reply *r) {
+    memset(r, 0, sizeof(*r));
+    r->file_fd = -1;
+
+    char method[8], url[MAX_URL], version[16];
+    if (sscanf(buffer, "%7s %1023s %15s", method, url, version) != 3 || strncmp(method, "GET", 3) != 0) {
+        r->status = 400;
+        return;
+    }
+
+    if (strstr(buffer, "Host:") == NULL) {
+        r->status = 400;
+        return;
+    }
+
+    if (is_connection_keep_alive(buffer)) {
+        r->keep_alive = 1;
+    } else if (is_connection_close(buffer)) {
+        r->keep_alive = 0;
+    } else {
+        // Connection 헤더 없을 경우: 버전에 따라 기본 정책 적용
+        if (strstr(version, "HTTP/1.1")) r->keep_alive = 1;
+    }
+
+    char *q = strchr(url, '?');
+    if (q) *q = '\0';
+
+    struct fentry *fe = cache_get(url);
+    if (fe) {
+        r->status = 200;
+        r->file_fd = fe->fd;   // -1 if the file is in memory
+        r->size = fe->size;
+        r->mtime = fe->mtime;
+        r->fe = fe;
+        parse_range(buffer, r);
+        return;
+    }
+
+    char filepath[2048];
+    snprintf(filepath, sizeof(filepath), "%s%s", g_rootDir, url);
+
+    struct stat path_stat;
+    if (stat(filepath, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
+        strncat(filepath, "/index.html", sizeof(filepath) - strlen(filepath) - 1);
+    }
+
+    int file_fd = open(filepath, O_RDONLY);
+    if (file_fd < 0) {
+        r->status = 404;
+        return;
+    }
+
+    struct stat st;
+    if (fstat(file_fd, &st) < 0) {
+        r->status = 500;
+        close(file_fd);
+        return;
+    }
+
+    r->status = 200;
+    r->file_fd = file_fd;
+    r->size = st.st_size;
+    r->mtime = st.st_mtime;
+    if (S_ISREG(st.st_mode)) r->fe = cache_put(url, filepath, file_fd, &st);
+    if (r->fe) r->file_fd = r->fe->fd;
+    if (S_ISREG(st.st_mode)) parse_range(buffer, r);
+}
+
 void handle_request(int client_fd) {
     char buffer[MAX_HDR + 1];
     int total_received = 0;
+    int corked = FALSE;
 
+    buffer[0] = '\0';
     while (1) {
-        memset(buffer, 0, sizeof(buffer));
-        total_received = 0;
-
-        // 누적 read() - 헤더 끝 찾을 때까지
-        while (total_received < MAX_HDR) {
+        // 누적 read() - 헤더 끝 찾을 때까지. 앞 요청 뒤에 남은 바이트는 유지
+        char *end;
+        while ((end = strstr(buffer, "\r\n\r\n")) == NULL && total_received < MAX_HDR) {
+            if (corked) {
+                // the pipelined replies so far go out before we block
+                int off = 0;
+                setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+                corked = FALSE;
+            }
             int r = read(client_fd, buffer + total_received, MAX_HDR - total_received);
             if (r <= 0) {
                 close(client_fd);
@@ -60,77 +604,422 @@ void handle_request(int client_fd) {
             }
             total_received += r;
             buffer[total_received] = '\0';
-            if (strstr(buffer, "\r\n\r\n")) break; // 헤더 끝 감지
         }
 
-        if (total_received >= MAX_HDR) {
+        if (end == NULL) {
             write(client_fd, errMessage400, strlen(errMessage400));
             break;
         }
 
-        char method[8], url[MAX_URL], version[16];
-        if (sscanf(buffer, "%7s %1023s %15s", method, url, version) != 3 || strncmp(method, "GET", 3) != 0) {
-            write(client_fd, errMessage400, strlen(errMessage400));
-            break;
+        // parse this request only, not the ones pipelined behind it
+        int used = end + 4 - buffer;
+        char saved = buffer[used];
+        buffer[used] = '\0';
+        struct reply r;
+        prepare_reply(buffer, &r);
+        buffer[used] = saved;
+        total_received -= used;
+        memmove(buffer, buffer + used, total_received + 1);
+
+        // another complete request is already here: hold the segments
+        // back so consecutive replies share them
+        if (!corked && r.keep_alive && strstr(buffer, "\r\n\r\n")) {
+            int on = 1;
+            setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+            corked = TRUE;
         }
 
-        if (strstr(buffer, "Host:") == NULL) {
-            write(client_fd, errMessage400, strlen(errMessage400));
-            break;
+        char hdr[256];
+        int hdrLen = reply_header(&r, hdr, sizeof(hdr));
+        if (r.status != 200 && r.status != 206) {
+            write(client_fd, hdr, hdrLen);
+            reply_done(&r);
+            if (r.status == 400 || !r.keep_alive) break;
+            else continue;
         }
 
-        int keep_alive = 0;
-        if (is_connection_keep_alive(buffer)) {
-            keep_alive = 1;
-        } else if (is_connection_close(buffer)) {
-            keep_alive = 0;
+        send(client_fd, hdr, hdrLen, reply_has_body(&r) ? MSG_MORE : 0);
+
+        if (r.status == 200) {
+            r.nranges = 1;   // the whole file, as one range
+            r.from[0] = 0;
+            r.to[0] = r.size - 1;
+        }
+        for (int k = 0; k <= r.nranges; k++) {
+            char part[128];
+            int partLen = part_header(&r, k, part, sizeof(part));
+            if (partLen > 0) send(client_fd, part, partLen, k < r.nranges ? MSG_MORE : 0);
+            if (k == r.nranges) break;
+
+            off_t offset = r.from[k];
+            while (offset <= r.to[k]) {
+                ssize_t sent = sendfile(client_fd, r.file_fd, &offset, r.to[k] + 1 - offset);
+                if (sent <= 0) break;
+            }
+        }
+
+        reply_done(&r);
+        if (!r.keep_alive) break;
+    }
+    close(client_fd);
+}
+
+static void conn_close(struct conn *c) {
+    reply_done(&c->r);
+    for (int i = 0; i < c->queued; i++) reply_done(&c->queue[i].r);
+    free(c->queue);
+    close(c->fd);   // also drops it from the epoll set
+    free(c);
+
+    if (g_acceptPaused) {
+        // a descriptor is free again
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, g_listenFd, &ev) == 0) g_acceptPaused = FALSE;
+    }
+}
+
+// waits for readable or writable next
+static int conn_want(int epfd, struct conn *c, uint32_t events) {
+    if (c->events == events) return 0;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    c->events = events;
+    return 0;
+}
+
+// the body of a 206: each range, behind its multipart header if there
+// are several, from memory or with sendfile() at the range's offset.
+// returns like conn_send()
+static int conn_send_ranges(struct conn *c) {
+    struct reply *r = &c->r;
+    while (c->part <= r->nranges) {
+        if (c->partSent < c->partLen) {
+            int more = (c->part < r->nranges) ? MSG_MORE : 0;
+            ssize_t n = send(c->fd, c->partHdr + c->partSent, c->partLen - c->partSent, more);
+            if (n < 0) return (errno == EAGAIN) ? 0 : -1;
+            c->partSent += n;
+            continue;
+        }
+        if (c->part < r->nranges && c->offset <= r->to[c->part]) {
+            size_t left = r->to[c->part] + 1 - c->offset;
+            ssize_t n;
+            if (r->fe && r->fe->data) {
+                // left runs to the end of the part, so only a part header
+                // or the closing boundary can follow it
+                int more = (r->nranges > 1) ? MSG_MORE : 0;
+                n = send(c->fd, r->fe->data + c->offset, left, more);
+                if (n > 0) c->offset += n;
+            } else {
+                n = sendfile(c->fd, r->file_fd, &c->offset, left);
+            }
+            if (n < 0) return (errno == EAGAIN) ? 0 : -1;
+            if (n == 0) return -1;
+            continue;
+        }
+        // on to the next range, or past the closing boundary
+        if (++c->part <= r->nranges) {
+            c->partLen = part_header(r, c->part, c->partHdr, sizeof(c->partHdr));
+            c->partSent = 0;
+            if (c->part < r->nranges) c->offset = r->from[c->part];
+        }
+    }
+    return 1;
+}
+
+// sends as much of the reply as the socket takes.
+// returns 1 when it is all out, 0 if the socket is full, -1 on error
+static int conn_send(struct conn *c) {
+    if (c->r.status == 200 && c->r.fe && c->r.fe->data) {
+        // header and body from memory in one writev()
+        while (c->hdrSent < c->hdrLen || c->offset < c->r.size) {
+            struct iovec iov[2] = {
+                { c->hdr + c->hdrSent, c->hdrLen - c->hdrSent },
+                { c->r.fe->data + c->offset, c->r.size - c->offset },
+            };
+            ssize_t n = writev(c->fd, iov, 2);
+            if (n < 0) return (errno == EAGAIN) ? 0 : -1;
+            ssize_t h = (n < (ssize_t)iov[0].iov_len) ? n : (ssize_t)iov[0].iov_len;
+            c->hdrSent += h;
+            c->offset += n - h;
+        }
+        return 1;
+    }
+    while (c->hdrSent < c->hdrLen) {
+        int more = reply_has_body(&c->r) ? MSG_MORE : 0;
+        ssize_t n = send(c->fd, c->hdr + c->hdrSent, c->hdrLen - c->hdrSent, more);
+        if (n < 0) return (errno == EAGAIN) ? 0 : -1;
+        c->hdrSent += n;
+    }
+    if (c->r.status == 206) return conn_send_ranges(c);
+    while (c->r.status == 200 && c->offset < c->r.size) {
+        ssize_t n = sendfile(c->fd, c->r.file_fd, &c->offset, c->r.size - c->offset);
+        if (n < 0) return (errno == EAGAIN) ? 0 : -1;
+        if (n == 0) return -1;   // the file shrank
+    }
+    return 1;
+}
+
+// sets up r as the connection's current reply, with sent bytes of its
+// header and body already out
+static void conn_start(struct conn *c, const struct reply *r, const char *hdr, int hdrLen, size_t sent) {
+    c->r = *r;
+    memcpy(c->hdr, hdr, hdrLen);
+    c->hdrLen = hdrLen;
+    c->hdrSent = (sent < hdrLen) ? sent : hdrLen;
+    c->offset = sent - c->hdrSent;
+    c->writing = TRUE;
+    if (r->status == 206) {
+        c->part = 0;
+        c->partLen = part_header(r, 0, c->partHdr, sizeof(c->partHdr));
+        c->partSent = 0;
+        c->offset = r->from[0];
+    }
+}
+
+// whether the body is a cached file's data, sent with the header
+static int reply_in_memory(const struct reply *r) {
+    return r->status == 200 && r->fe && r->fe->data;
+}
+
+// whether a batch ends at this reply: it closes the connection or its
+// body goes out with sendfile()
+static int batch_ends(const struct reply *r) {
+    return r->status == 400 || !r->keep_alive || (reply_has_body(r) && !reply_in_memory(r));
+}
+
+// sends up to PIPELINE replies -- those queued by the last batch, then
+// those of complete requests in the buffer -- with their headers, and the
+// bodies of files held in memory, in one sendmsg(). a batch ends at a
+// reply for which batch_ends(). the first reply not fully out becomes
+// the current one; the ones behind it are queued on the connection.
+// returns the number of replies finished, -1 when the connection is done
+static int conn_batch(struct conn *c) {
+    struct pending ps[PIPELINE];
+    struct iovec iov[2 * PIPELINE];
+    int n, niov = 0, from = 0;
+
+    if (c->queued > 0) memcpy(ps, c->queue, c->queued * sizeof(ps[0]));
+    n = c->queued;
+    c->queued = 0;
+    while (n < PIPELINE && (n == 0 || !batch_ends(&ps[n - 1].r))) {
+        struct reply *r = &ps[n].r;
+        char *end = strstr(c->buffer + from, "\r\n\r\n");
+        int next;
+        if (end == NULL) {
+            if (n > 0 || c->len < MAX_HDR) break;
+            memset(r, 0, sizeof(*r));
+            r->status = 400;
+            r->file_fd = -1;
+            next = c->len;
+        } else {
+            next = end + 4 - c->buffer;
+            char saved = c->buffer[next];
+            c->buffer[next] = '\0';
+            prepare_reply(c->buffer + from, r);
+            c->buffer[next] = saved;
+        }
+        if (r->fe && r->status == 200) {
+            ps[n].hdrLen = r->fe->hdrLen[r->keep_alive];
+            memcpy(ps[n].hdr, r->fe->hdr[r->keep_alive], ps[n].hdrLen);
         } else {
-            // Connection 헤더 없을 경우: 버전에 따라 기본 정책 적용
-            if (strstr(version, "HTTP/1.1")) keep_alive = 1;
+            ps[n].hdrLen = reply_header(r, ps[n].hdr, sizeof(ps[n].hdr));
         }
+        from = next;
+        n++;
+    }
+    // the parsed requests are in ps now
+    c->len -= from;
+    memmove(c->buffer, c->buffer + from, c->len + 1);
+    if (n == 0) return 0;
 
-        char filepath[2048];
-        snprintf(filepath, sizeof(filepath), "%s%s", g_rootDir, url);
-        char *q = strchr(filepath, '?');
-        if (q) *q = '\0';
+    for (int k = 0; k < n; k++) {
+        const struct reply *r = &ps[k].r;
+        iov[niov].iov_base = ps[k].hdr;
+        iov[niov++].iov_len = ps[k].hdrLen;
+        if (reply_in_memory(r) && r->size > 0) {
+            iov[niov].iov_base = r->fe->data;
+            iov[niov++].iov_len = r->size;
+        }
+    }
+    // the body of the last one may follow with sendfile()
+    const struct reply *last = &ps[n - 1].r;
+    int more = (reply_has_body(last) && !reply_in_memory(last)) ? MSG_MORE : 0;
 
-        struct stat path_stat;
-        if (stat(filepath, &path_stat) == 0 && S_ISDIR(path_stat.st_mode)) {
-            strncat(filepath, "/index.html", sizeof(filepath) - strlen(filepath) - 1);
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = niov };
+    ssize_t sent = sendmsg(c->fd, &msg, more);
+    if (sent < 0) {
+        if (errno != EAGAIN) {
+            for (int k = 0; k < n; k++) reply_done(&ps[k].r);
+            return -1;
         }
+        sent = 0;
+    }
 
-        int file_fd = open(filepath, O_RDONLY);
-        if (file_fd < 0) {
-            write(client_fd, errMessage404, strlen(errMessage404));
-            if (!keep_alive) break;
-            else continue;
+    int k, done = TRUE;
+    for (k = 0; k < n; k++) {
+        const struct reply *r = &ps[k].r;
+        int inMemory = reply_in_memory(r);
+        size_t len = ps[k].hdrLen + (inMemory ? r->size : 0);
+        int body = reply_has_body(r) && !inMemory;   // still to sendfile()
+        if (sent < len || body) {
+            conn_start(c, r, ps[k].hdr, ps[k].hdrLen, sent);
+            break;
         }
+        sent -= len;
+        done = done && r->status != 400 && r->keep_alive;
+        reply_done(&ps[k].r);
+    }
+    if (k + 1 < n) {
+        if (c->queue == NULL) c->queue = (struct pending *)malloc(PIPELINE * sizeof(c->queue[0]));
+        if (c->queue == NULL) {
+            for (int j = k + 1; j < n; j++) reply_done(&ps[j].r);
+            return -1;
+        }
+        c->queued = n - k - 1;
+        memcpy(c->queue, ps + k + 1, c->queued * sizeof(ps[0]));
+    }
+    return done ? k : -1;
+}
 
-        struct stat st;
-        if (fstat(file_fd, &st) < 0) {
-            write(client_fd, errMessage500, strlen(errMessage500));
-            close(file_fd);
-            if (!keep_alive) break;
-            else continue;
+// answers every complete request in the buffer, in order.
+// returns -1 when the connection is done
+static int conn_serve(int epfd, struct conn *c) {
+    while (1) {
+        if (!c->writing) {
+            int n = conn_batch(c);
+            if (n < 0) return -1;
+            if (!c->writing) {
+                if (n > 0) continue;
+                return c->peerClosed ? -1 : conn_want(epfd, c, EPOLLIN);
+            }
         }
 
-        dprintf(client_fd, "HTTP/1.0 200 OK\r\nContent-length: %ld\r\nConnection: %s\r\n\r\n",
-                st.st_size, keep_alive ? "Keep-Alive" : "close");
+        int done = conn_send(c);
+        if (done < 0) return -1;
+        if (done == 0) return conn_want(epfd, c, EPOLLOUT);
 
-        off_t offset = 0;
-        while (offset < st.st_size) {
-            ssize_t sent = sendfile(client_fd, file_fd, &offset, st.st_size - offset);
-            if (sent <= 0) break;
+        reply_done(&c->r);
+        c->writing = FALSE;
+        if (c->r.status == 400 || !c->r.keep_alive) return -1;
+    }
+}
+
+// reads what has arrived, then answers it. a client may half-close
+// right after its requests; they are still answered.
+// returns -1 when the connection is done
+static int conn_input(int epfd, struct conn *c) {
+    while (c->len < MAX_HDR && !c->peerClosed) {
+        ssize_t n = read(c->fd, c->buffer + c->len, MAX_HDR - c->len);
+        if (n == 0) {
+            c->peerClosed = TRUE;
+            break;
         }
+        if (n < 0) {
+            if (errno == EAGAIN) break;
+            return -1;
+        }
+        c->len += n;
+        c->buffer[c->len] = '\0';
+    }
+    return conn_serve(epfd, c);
+}
 
-        close(file_fd);
-        if (!keep_alive) break;
+// accepts every pending connection
+static void accept_all(int epfd, int listen_fd) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+            if (cache_shed()) continue;
+            // the listener would stay readable and spin the loop: disarm
+            // it until a connection closes
+            static int warned = FALSE;
+            if (!warned) perror("accept (pausing until a connection closes)");
+            warned = TRUE;
+            struct epoll_event ev = { .events = 0, .data.ptr = NULL };
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, listen_fd, &ev) == 0) g_acceptPaused = TRUE;
+            return;
+        }
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) perror("accept");
+            return;
+        }
+        struct conn *c = (struct conn *)calloc(1, sizeof(*c));
+        if (c == NULL) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->r.file_fd = -1;
+        c->events = EPOLLIN;
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(c);
+        }
+    }
+}
+
+// -e: serves every connection from one epoll loop. a connection reads its
+// header, opens the file, sends the reply header and then the file with
+// sendfile(); whenever the socket would block it waits for EPOLLOUT and
+// resumes where it stopped.
+static void run_epoll(int listen_fd) {
+    // a few thousand clients need more than the default 1024 descriptors
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    g_epfd = epfd;
+    g_listenFd = listen_fd;
+    if (g_cacheFiles > 0) cache_init(epfd, g_cacheFiles);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (g_report) {
+            g_report = FALSE;
+            cache_report();
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+        for (int k = 0; k < n; k++) {
+            struct conn *c = (struct conn *)events[k].data.ptr;
+            if (c == NULL) {
+                accept_all(epfd, listen_fd);
+                continue;
+            }
+            if ((void *)c == &g_cache) {
+                cache_events();
+                continue;
+            }
+            int r = c->writing ? conn_serve(epfd, c) : conn_input(epfd, c);
+            if (r < 0) conn_close(c);
+        }
     }
-    close(client_fd);
 }
 
 static void PrintUsage(const char* prog) {
-    printf("usage: %s -p port -d rootDirectory(optional) \n", prog);
+    printf("usage: %s -p port -d rootDirectory(optional) -e(optional, epoll loop) -c cachedFiles -m memoryKB -s smallFileBytes(optional, with -e) \n", prog);
 }
 
 int main(const int argc, const char** argv) {
@@ -145,6 +1034,17 @@ int main(const int argc, const char** argv) {
         } else if (strcmp(argv[i], "-d") == 0 && (i+1) < argc) {
             g_rootDir = argv[i+1];
             i++;
+        } else if (strcmp(argv[i], "-e") == 0) {
+            g_epoll = TRUE;
+        } else if (strcmp(argv[i], "-c") == 0 && (i+1) < argc) {
+            g_cacheFiles = atoi(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-m") == 0 && (i+1) < argc) {
+            g_cacheMem = atol(argv[i+1]);
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0 && (i+1) < argc) {
+            g_smallFile = atol(argv[i+1]);
+            i++;
         }
     }
     if (port <= 0 || port > 65535) {
@@ -188,6 +1088,10 @@ int main(const int argc, const char** argv) {
         exit(1);
     }
 
+    if (g_epoll) {
+        run_epoll(listen_fd);
+    }
+
     // Accept loop
     while (1) {
         struct sockaddr_in cliaddr;
@@ -205,6 +1109,6 @@ int main(const int argc, const char** argv) {
             exit(0);
         }
         close(conn_fd);
-        waitpid(-1, NULL, WNOHANG);
+        while (waitpid(-1, NULL, WNOHANG) > 0);   // every finished child, not just one
     }
 }
@@ -0,0 +1,59 @@
+#!/bin/bash
+# error replies and range replies of shttpd, in fork and epoll mode.
+# usage: ./test_replies.sh
+#
+# each case sends one raw request and checks the status line; the server
+# must still answer a normal GET afterwards. exits non-zero on a failure.
+
+PORT=$((20000 + RANDOM % 20000))
+FAILS=0
+
+if [ ! -x ./shttpd ]; then
+    echo "build shttpd first (make)"
+    exit 1
+fi
+
+# request on stdin, reply on stdout
+ask() {
+    exec 3<>/dev/tcp/127.0.0.1/$PORT || return 1
+    cat >&3
+    timeout 5 cat <&3 2>/dev/null
+    exec 3<&-
+}
+
+expect() {
+    local name=$1 want=$2 got
+    got=$(ask | head -1 | tr -d '\r')
+    if [[ "$got" == *" $want "* ]]; then
+        echo "ok   ${MODE:-fork} $name"
+    else
+        echo "FAIL ${MODE:-fork} $name: got \"$got\", want $want"
+        FAILS=$((FAILS + 1))
+    fi
+}
+
+LONG=$(head -c 2000 /dev/zero | tr '\0' 'a')
+for MODE in "" "-e"; do
+    ./shttpd -p $PORT $MODE -d test_root 2>/dev/null &
+    SPID=$!
+    sleep 0.3
+
+    printf 'GET /nope HTTP/1.0\r\nHost: x\r\n\r\n' | expect "missing file" 404
+    printf 'GET /nope HTTP/1.1\r\nHost: x\r\nConnection: close\r\n\r\n' | expect "missing file, close" 404
+    printf 'GET /hello.txt HTTP/1.0\r\nHost: x\r\nX-Long: %s\r\n\r\n' "$LONG" | expect "oversized header" 400
+    printf 'GET /hello.txt HTTP/1.0\r\n\r\n' | expect "no Host" 400
+    printf 'GET /hello.txt HTTP/1.0\r\nHost: x\r\nRange: bytes=0-4\r\n\r\n' | expect "range" 206
+    printf 'GET /hello.txt HTTP/1.0\r\nHost: x\r\nRange: bytes=999-\r\n\r\n' | expect "range past end" 416
+    printf 'GET /hello.txt HTTP/1.0\r\nHost: x\r\n\r\n' | expect "still serving" 200
+
+    if ! kill -0 $SPID 2>/dev/null; then
+        echo "FAIL ${MODE:-fork} server exited"
+        FAILS=$((FAILS + 1))
+    fi
+    kill $SPID 2>/dev/null
+    wait $SPID 2>/dev/null
+    PORT=$((PORT + 1))
+done
+
+[ $FAILS -eq 0 ] && echo "all passed"
+exit $FAILS